@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <stdio.h>
+#include <opencv2/opencv.hpp>
+
+#include "util.hpp"
+#include "config.hpp"
+#include "markers.hpp"
+#include "stitcher.hpp"
+#include "canvas.hpp"
+#include "grid.hpp"
+#include "scene.hpp"
+#include "profile.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Microbenchmarks for the registration hot paths, on rendered scenes (see scene.hpp) so
+// results only depend on the build and the machine. Results are written as JSON for comparing commits.
+//
+//   handicam_bench [out.json] [filter]
+//
+// Only benchmarks whose name contains filter are run.
+
+class Bench {
+  public:
+    Bench(const string& _filter) {
+      filter = _filter;
+    }
+
+    // Time f over iterations runs, after untimed warm-up runs that fill the frame pool.
+    template<typename F>
+    void run(const string& name, int iterations, F f) {
+      if (name.find(filter) == string::npos) {
+	return;
+      }
+      for (int i=0; i<3; i++) {
+	f();
+      }
+      uint64_t allocations = FramePool::allocations();
+      vector<double> times;
+      for (int i=0; i<iterations; i++) {
+	int64_t t = Profiler::now();
+	f();
+	times.push_back((Profiler::now() - t) / 1e6);
+      }
+      sort(times.begin(), times.end());
+
+      Result r;
+      r.name = name;
+      r.iterations = iterations;
+      r.allocations = FramePool::allocations() - allocations;
+      r.min = times.front();
+      r.median = times[times.size() / 2];
+      r.p95 = times[std::min((int)times.size() - 1, (int)ceil(times.size() * 0.95) - 1)];
+      r.max = times.back();
+      r.mean = 0;
+      for (int i=0; i<times.size(); i++) {
+	r.mean += times[i] / times.size();
+      }
+      results.push_back(r);
+      printf("%-40s n=%-4d mean=%9.3f median=%9.3f p95=%9.3f ms  allocs=%llu\n",
+	     name.c_str(), iterations, r.mean, r.median, r.p95,
+	     (unsigned long long)r.allocations);
+      fflush(stdout);
+    }
+
+    bool write(const string& file) {
+      FileStorage fs(file, FileStorage::WRITE);
+      if (!fs.isOpened()) {
+	LOG(ERROR) << "Failed to write " << file << endl;
+	return false;
+      }
+      fs << "opencv" << CV_VERSION;
+      fs << "threads" << getNumThreads();
+#ifdef HANDICAM_CPU_MAT
+      fs << "image" << "Mat";
+#else
+      fs << "image" << "UMat";
+#endif
+      fs << "benchmarks" << "[";
+      for (int i=0; i<results.size(); i++) {
+	const Result& r = results[i];
+	fs << "{:" << "name" << r.name << "iterations" << r.iterations
+	   << "mean_ms" << r.mean << "median_ms" << r.median << "min_ms" << r.min
+	   << "p95_ms" << r.p95 << "max_ms" << r.max
+	   << "pool_allocations" << (int)r.allocations << "}";
+      }
+      fs << "]";
+      fs.release();
+      return true;
+    }
+
+  private:
+    struct Result {
+      string name;
+      int iterations;
+      // Frame pool buffers allocated during the timed runs; 0 in steady state.
+      uint64_t allocations;
+      double mean;
+      double median;
+      double min;
+      double p95;
+      double max;
+    };
+
+    string filter;
+
+    vector<Result> results;
+};
+
+int main(int argc, char** argv) {
+  string out = argc > 1 ? argv[1] : "bench.json";
+  Bench bench(argc > 2 ? argv[2] : "");
+
+  // Synthetic intrinsics, so results don't depend on the local calibration.
+  Config config;
+  config.cameraMatrix = Mat(Matx33d(config.image_width, 0, config.image_width / 2,
+				     0, config.image_width, config.image_height / 2,
+				     0, 0, 1));
+  config.distCoeffs = Mat::zeros(1, 5, CV_64F);
+
+  Markers markers(config, false);
+  SceneGenerator scene(config);
+  Image frame, frame2, proj, proj2, frameCopy;
+  scene.render(3, 3, 0).img.copyTo(frame);
+  frame.copyTo(frameCopy);
+  if (markers.getArucoOrientedImage(frameCopy, proj) != Markers::Status::OK) {
+    LOG(ERROR) << "Fixture markers weren't detected." << endl;
+    return -1;
+  }
+
+  // The same surface seen a little later: moved and turned slightly.
+  scene.render(3.3, 3.2, 2).img.copyTo(frame2);
+  if (markers.getArucoOrientedImage(frame2, proj2) != Markers::Status::OK) {
+    LOG(ERROR) << "Fixture markers weren't detected." << endl;
+    return -1;
+  }
+
+  bench.run("markers/oriented_image", 20, [&]() {
+      frame.copyTo(frameCopy);
+      Image p;
+      markers.getArucoOrientedImage(frameCopy, p);
+    });
+
+  Point2f quad[4] = {Point2f(100, 40), Point2f(1100, 60),
+		     Point2f(1080, 700), Point2f(120, 680)};
+  bench.run("markers/perspective", 20, [&]() {
+      markers.getPerspective(frame, quad);
+    });
+
+  // Crosses between Image and Mat unless built with HANDICAM_CPU_MAT.
+  bench.run("util/imscale", 50, [&]() {
+      imscale(600, proj);
+    });
+
+  Mat gray;
+  cvtColor(proj, gray, CV_BGR2GRAY);
+  bench.run("stitcher/mask_erosion", 50, [&]() {
+      Mat mask;
+      IncrementalStitcher::featureMask(gray, mask);
+    });
+
+  const char* detectNames[] = {"surf", "orb", "sift"};
+  const char* extractNames[] = {"surf", "orb", "freak", "brisk"};
+  for (int d=0; d<3; d++) {
+    for (int e=0; e<4; e++) {
+      // ORB can't describe SIFT keypoints, whose octave field it misreads.
+      if (d == IncrementalStitcher::DetectMethod::DETECT_SIFT &&
+	  e == IncrementalStitcher::ExtractMethod::EXTRACT_ORB) {
+	continue;
+      }
+      IncrementalStitcher stitcher(1.0, IncrementalStitcher::MatchMode::AGGREGATE,
+				   (IncrementalStitcher::DetectMethod)d,
+				   (IncrementalStitcher::ExtractMethod)e);
+      bench.run(string("features/") + detectNames[d] + "_" + extractNames[e], 10, [&]() {
+	  detail::ImageFeatures f;
+	  stitcher.detectFeatures(proj, f);
+	});
+    }
+  }
+
+  IncrementalStitcher stitcher(1.0, IncrementalStitcher::MatchMode::AGGREGATE,
+			       IncrementalStitcher::DetectMethod::DETECT_SURF,
+			       IncrementalStitcher::ExtractMethod::EXTRACT_FREAK);
+  vector<detail::ImageFeatures> features(2);
+  stitcher.detectFeatures(proj, features[0]);
+  stitcher.detectFeatures(proj2, features[1]);
+  features[1].img_idx = 1;
+  bench.run("stitcher/affine_matcher", 20, [&]() {
+      vector<detail::MatchesInfo> matches;
+      detail::AffineBestOf2NearestMatcher(false, true, 0.3f)(features, matches);
+    });
+
+  // Compose one frame into the middle of ever larger canvases; the cost shouldn't grow.
+  const int canvasSizes[] = {2048, 4096, 8192, 16384};
+  for (int i=0; i<4; i++) {
+    int size = canvasSizes[i];
+    Canvas canvas;
+    canvas.extend(Rect(0, 0, size, size));
+    Point offset(size/2 - proj.cols/2, size/2 - proj.rows/2);
+    bench.run("canvas/compose_" + to_string(size), 10, [&]() {
+	canvas.compose(proj, offset);
+      });
+  }
+
+  // A frame rotated into a canvas: warping the image and a mask and copying one through the
+  // other, as composing did before, against warping straight into the tiles.
+  {
+    Mat src = asMat(proj);
+    Mat r = getRotationMatrix2D(Point2f(src.cols/2, src.rows/2), 3.0, 1.0);
+    Matx33f H(r.at<double>(0,0), r.at<double>(0,1), r.at<double>(0,2),
+	      r.at<double>(1,0), r.at<double>(1,1), r.at<double>(1,2),
+	      0, 0, 1);
+    Mat_<float> K = Mat::eye(3, 3, CV_32F);
+    Ptr<detail::RotationWarper> w = Ptr<WarperCreator>(new cv::AffineWarper())->create(1.0);
+    Canvas canvas;
+    bench.run("warp/two_pass", 20, [&]() {
+	Mat wimg, wmask;
+	Mat mask(src.size(), CV_8U, Scalar::all(255));
+	Point tl = w->warp(src, K, Mat(H), INTER_AREA, BORDER_REFLECT, wimg);
+	w->warp(mask, K, Mat(H), INTER_NEAREST, BORDER_CONSTANT, wmask);
+	canvas.compose(asImage(wimg), asImage(wmask), tl);
+      });
+    bench.run("warp/fused", 20, [&]() {
+	AffineWarp warp(src, H.get_minor<2, 3>(0, 0), true);
+	canvas.compose(warp);
+      });
+
+    // Each compose policy, for a frame that's mostly over existing content, as when scanning.
+    const char* policies[] = {"newest", "fill", "seam"};
+    for (int i=0; i<3; i++) {
+      AffineWarp::Policy policy;
+      AffineWarp::parsePolicy(policies[i], policy);
+      Canvas covered;
+      covered.setPolicy(policy);
+      AffineWarp first(src, H.get_minor<2, 3>(0, 0), true);
+      covered.compose(first);
+      Matx33f next = H * Matx33f(1, 0, -20, 0, 1, -10, 0, 0, 1);
+      bench.run(string("canvas/policy_") + policies[i], 20, [&]() {
+	  AffineWarp warp(src, next.get_minor<2, 3>(0, 0), true);
+	  covered.compose(warp);
+	});
+    }
+  }
+
+  // One frame through markers, matching and compositing, as stitch_stream does: each
+  // frame is matched against the last keyframe, alternating between the two views so the
+  // keyframe test sees motion.
+  IncrementalStitcher pipeline(1.0, IncrementalStitcher::MatchMode::PAIRWISE,
+			       IncrementalStitcher::DetectMethod::DETECT_SURF,
+			       IncrementalStitcher::ExtractMethod::EXTRACT_FREAK);
+  Image base = proj.clone(); // stitchFrame overwrites it with the next base.
+  int frames = 0;
+  bench.run("pipeline/frame", 20, [&]() {
+      Image p;
+      (frames++ % 2 == 0 ? frame2 : frame).copyTo(frameCopy);
+      if (markers.getArucoOrientedImage(frameCopy, p) != Markers::Status::OK) {
+	return;
+      }
+      IncrementalStitcher::FrameResult result;
+      pipeline.stitchFrame(base, p, Size(config.image_width, config.image_height), result);
+    });
+
+  float cpi = proj.cols / config.markerboard_project_width;
+  float rpi = proj.rows / config.markerboard_project_height;
+  bench.run("grid/handle_grid_change", 20, [&]() {
+      Grid grid(3, 3, config.markerboard_width, config.markerboard_height,
+		config.markerboard_project_width, config.markerboard_project_height, cpi, rpi);
+      Canvas canvas;
+      grid.handleGridChange(canvas);
+    });
+
+  return bench.write(out) ? 0 : -1;
+}
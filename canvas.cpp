@@ -0,0 +1,344 @@
+#include "canvas.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Floor division, so negative coordinates round toward negative infinity.
+static int floorDiv(int v, int d) {
+  return v >= 0 ? v / d : -((-v + d - 1) / d);
+}
+
+static int ceilDiv(int v, int d) {
+  return -floorDiv(-v, d);
+}
+
+Canvas::Canvas(int _tileSize, int _type, int _levels) {
+  store = makePtr<MemoryTileStore>(_tileSize, _type);
+  stamps = makePtr<MemoryTileStore>(_tileSize, CV_16U);
+  tileSize = _tileSize;
+  type = _type;
+  levels = _levels;
+}
+
+Canvas::Canvas(Ptr<TileStore> _store, Ptr<TileStore> _stamps, int _levels) {
+  store = _store;
+  stamps = _stamps;
+  tileSize = store->getTileSize();
+  type = store->getType();
+  area = store->getBounds();
+  levels = _levels;
+}
+
+Rect Canvas::bounds() {
+  return area;
+}
+
+bool Canvas::empty() {
+  return area.area() == 0;
+}
+
+int Canvas::getTileSize() {
+  return tileSize;
+}
+
+void Canvas::tiles(int level, vector<Point>& out) {
+  vector<TileKey> keys;
+  store->keys(keys);
+  out.clear();
+  for (int i=0; i<keys.size(); i++) {
+    if (keys[i].level == level) {
+      out.push_back(Point(keys[i].x, keys[i].y));
+    }
+  }
+}
+
+Mat Canvas::readTile(Point tile, int level) {
+  TileKey key = {tile.x, tile.y, level};
+  return store->get(key, false).clone();
+}
+
+int Canvas::getLevels() {
+  return levels;
+}
+
+void Canvas::flush() {
+  store->flush();
+}
+
+void Canvas::extend(Rect r) {
+  if (r.area() == 0) {
+    return;
+  }
+  Rect grown = empty() ? r : (area | r);
+  if (grown != area) {
+    area = grown;
+    store->setBounds(area);
+  }
+}
+
+int Canvas::tileIndex(int v) {
+  return floorDiv(v, tileSize);
+}
+
+Rect Canvas::tileRect(TileKey key) {
+  return Rect(key.x*tileSize, key.y*tileSize, tileSize, tileSize);
+}
+
+Rect Canvas::levelRect(Rect r, int level) {
+  int d = 1 << level;
+  return Rect(Point(floorDiv(r.x, d), floorDiv(r.y, d)),
+	      Point(ceilDiv(r.x + r.width, d), ceilDiv(r.y + r.height, d)));
+}
+
+int Canvas::levelFor(int width) {
+  int level = 0;
+  while (level < levels && (area.width >> (level + 1)) >= width) {
+    level++;
+  }
+  return level;
+}
+
+void Canvas::compose(Image img, Point offset) {
+  compose(img, Image(), offset);
+}
+
+void Canvas::compose(Image img, Image mask, Point offset) {
+  Rect r(offset, img.size());
+  extend(r);
+  composed++;
+
+  Mat src = asMat(img);
+  Mat srcMask;
+  if (!mask.empty()) {
+    srcMask = asMat(mask);
+  }
+  writeLevel(src, srcMask, offset, 0);
+  updatePyramid(r);
+}
+
+void Canvas::compose(AffineWarp& warp) {
+  Rect r = warp.bounds();
+  if (r.area() == 0) {
+    return;
+  }
+  extend(r);
+  composed++;
+
+  // Tiles are only valid until the next get(), so they're warped into one at a time.
+  for (int ty=tileIndex(r.y); ty<=tileIndex(r.y + r.height - 1); ty++) {
+    for (int tx=tileIndex(r.x); tx<=tileIndex(r.x + r.width - 1); tx++) {
+      TileKey key = {tx, ty, 0};
+      Rect tr = tileRect(key);
+      Rect isect = tr & r;
+      if (!warp.covers(isect)) {
+	continue; // Nothing to write; don't allocate the tile.
+      }
+      Mat st = stampTile(key, true)(isect - tr.tl());
+      if (policy == AffineWarp::Policy::FILL_UNCOVERED &&
+	  countNonZero(st) == isect.area()) {
+	continue; // Already covered; don't page the tile in.
+      }
+      Mat tile = store->get(key, true);
+      warp.compose(tile(isect - tr.tl()), st, isect.tl(), policy, stamp(), band);
+    }
+  }
+  updatePyramid(r);
+}
+
+void Canvas::setPolicy(AffineWarp::Policy _policy, int _band) {
+  policy = _policy;
+  band = _band;
+}
+
+AffineWarp::Policy Canvas::getPolicy() {
+  return policy;
+}
+
+int Canvas::getComposeCount() {
+  return composed;
+}
+
+ushort Canvas::stamp() {
+  return (ushort)std::min(composed, 65535);
+}
+
+Mat Canvas::stampTile(TileKey key, bool create) {
+  Mat st = stamps->get(key, false);
+  if (!st.empty()) {
+    return st;
+  }
+  Mat tile = store->get(key, false);
+  if (tile.empty() && !create) {
+    return Mat();
+  }
+  st = stamps->get(key, true);
+  if (!tile.empty()) {
+    Mat blank;
+    inRange(tile, Scalar::all(0), Scalar::all(0), blank);
+    st.setTo(Scalar(1));
+    st.setTo(Scalar(0), blank);
+  }
+  return st;
+}
+
+Mat Canvas::readCoverage(Rect r) {
+  Mat dst = Mat::zeros(r.height, r.width, CV_16U);
+  for (int ty=tileIndex(r.y); ty<=tileIndex(r.y + r.height - 1); ty++) {
+    for (int tx=tileIndex(r.x); tx<=tileIndex(r.x + r.width - 1); tx++) {
+      TileKey key = {tx, ty, 0};
+      Mat st = stampTile(key, false);
+      if (st.empty()) {
+	continue;
+      }
+      Rect tr = tileRect(key);
+      Rect isect = tr & r;
+      st(isect - tr.tl()).copyTo(dst(isect - r.tl()));
+    }
+  }
+  return dst;
+}
+
+double Canvas::coverage(Rect r) {
+  if (r.area() == 0) {
+    return 0;
+  }
+  return (double)countNonZero(readCoverage(r)) / r.area();
+}
+
+double Canvas::coverage(AffineWarp& warp) {
+  Rect r = warp.bounds();
+  int64 total = 0, covered = 0;
+  for (int y=r.y; y<r.y + r.height; y++) {
+    int x0, x1;
+    if (warp.span(y, x0, x1)) {
+      total += x1 - x0;
+    }
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  for (int ty=tileIndex(r.y); ty<=tileIndex(r.y + r.height - 1); ty++) {
+    for (int tx=tileIndex(r.x); tx<=tileIndex(r.x + r.width - 1); tx++) {
+      TileKey key = {tx, ty, 0};
+      Mat st = stampTile(key, false);
+      if (st.empty()) {
+	continue;
+      }
+      Rect tr = tileRect(key);
+      Rect isect = tr & r;
+      for (int y=isect.y; y<isect.y + isect.height; y++) {
+	int x0, x1;
+	if (!warp.span(y, x0, x1)) {
+	  continue;
+	}
+	x0 = std::max(x0, isect.x);
+	x1 = std::min(x1, isect.x + isect.width);
+	const ushort* row = st.ptr<ushort>(y - tr.y);
+	for (int x=x0; x<x1; x++) {
+	  covered += row[x - tr.x] != 0;
+	}
+      }
+    }
+  }
+  return (double)covered / total;
+}
+
+void Canvas::writeLevel(Mat src, Mat mask, Point offset, int level) {
+  Rect r(offset, src.size());
+
+  // Visit only the tiles under r.
+  for (int ty=tileIndex(r.y); ty<=tileIndex(r.y + r.height - 1); ty++) {
+    for (int tx=tileIndex(r.x); tx<=tileIndex(r.x + r.width - 1); tx++) {
+      TileKey key = {tx, ty, level};
+      Rect tr = tileRect(key);
+      Rect isect = tr & r;
+      Rect sr = isect - offset;
+      if (!mask.empty() && countNonZero(mask(sr)) == 0) {
+	continue; // Nothing to write; don't allocate the tile.
+      }
+
+      if (level == 0) {
+	Mat st = stampTile(key, true)(isect - tr.tl());
+	if (mask.empty()) {
+	  st.setTo(Scalar(stamp()));
+	} else {
+	  st.setTo(Scalar(stamp()), mask(sr));
+	}
+      }
+
+      Mat tile = store->get(key, true);
+      if (mask.empty()) {
+	src(sr).copyTo(tile(isect - tr.tl()));
+      } else {
+	src(sr).copyTo(tile(isect - tr.tl()), mask(sr));
+      }
+    }
+  }
+}
+
+void Canvas::updatePyramid(Rect dirty) {
+  for (int level=1; level<=levels; level++) {
+    // Each pixel averages a 2x2 block of the level below, so rebuild every block the dirty
+    // region touches.
+    Rect r = levelRect(dirty, level);
+    Mat src = readLevel(Rect(r.x*2, r.y*2, r.width*2, r.height*2), level - 1);
+    if (countNonZero(src.reshape(1)) == 0) {
+      continue; // Masked-out region; leave coarse tiles unallocated.
+    }
+    Mat dst;
+    resize(src, dst, r.size(), 0, 0, INTER_AREA);
+    writeLevel(dst, Mat(), r.tl(), level);
+  }
+}
+
+Mat Canvas::readLevel(Rect r, int level) {
+  Mat dst = Mat::zeros(r.height, r.width, type);
+  for (int ty=tileIndex(r.y); ty<=tileIndex(r.y + r.height - 1); ty++) {
+    for (int tx=tileIndex(r.x); tx<=tileIndex(r.x + r.width - 1); tx++) {
+      TileKey key = {tx, ty, level};
+      Mat tile = store->get(key, false);
+      if (tile.empty()) {
+	continue;
+      }
+      Rect tr = tileRect(key);
+      Rect isect = tr & r;
+      tile(isect - tr.tl()).copyTo(dst(isect - r.tl()));
+    }
+  }
+  return dst;
+}
+
+Image Canvas::read(Rect r) {
+  return read(r, 0);
+}
+
+Image Canvas::read(Rect r, int level) {
+  Image udst;
+  readLevel(levelRect(r, level), level).copyTo(udst);
+  return udst;
+}
+
+Image Canvas::toImage() {
+  if (empty()) {
+    return Image();
+  }
+  return read(area);
+}
+
+Image Canvas::preview(int width) {
+  if (empty()) {
+    return Image();
+  }
+
+  // Start from the nearest pyramid level, so the cost doesn't grow with the canvas.
+  int level = levelFor(width);
+  Mat src = readLevel(levelRect(area, level), level);
+  double scale = (double)width / area.width;
+  Mat dst;
+  resize(src, dst, Size(width, std::max(1, cvRound(area.height * scale))), 0, 0, INTER_AREA);
+
+  Image udst;
+  dst.copyTo(udst);
+  return udst;
+}
@@ -0,0 +1,147 @@
+#include <opencv2/opencv.hpp>
+#include "util.hpp"
+#include "tilestore.hpp"
+#include "warp.hpp"
+
+#ifndef CANVAS
+#define CANVAS
+
+using namespace cv;
+using namespace std;
+
+/**
+ * Sparse image made of fixed-size tiles in a signed coordinate system. Content can grow in
+ * any direction without copying, and writes only touch the tiles they overlap. Tiles live
+ * in a TileStore, which may keep them in RAM or page them from disk.
+ *
+ * The canvas also keeps a mipmap pyramid: level n is level 0 downscaled by 2^n, stored in
+ * tiles of the same size. Composition updates only the pyramid tiles under the written
+ * region, so reading a coarse level costs the same however large the canvas grows.
+ *
+ * A coverage map records which compose last wrote each pixel, so callers can ask what's
+ * covered and how recently, and warped frames can be composed by a policy that leaves
+ * existing content alone or blends into it. The map is 2 bytes per pixel of content, kept in
+ * a second tile store of CV_16U tiles, so a mapped canvas can page it out like its tiles.
+ * Content already in the tile store counts as written by the first compose.
+ */
+class Canvas {
+  public:
+    /** In-memory canvas. */
+    Canvas(int tileSize=256, int type=CV_8UC3, int levels=6);
+
+    /** Canvas over an existing tile store, keeping coverage stamps in stamps, a store of
+	CV_16U tiles of the same size. */
+    Canvas(Ptr<TileStore> store, Ptr<TileStore> stamps, int levels=6);
+
+    /** Bounds of all content written or reserved, in canvas coordinates. */
+    Rect bounds();
+
+    bool empty();
+
+    /** Grow bounds to include r. Doesn't allocate tiles. */
+    void extend(Rect r);
+
+    /** Copy img into the canvas with its top-left at offset. */
+    void compose(Image img, Point offset);
+
+    /** Copy img into the canvas with its top-left at offset, where mask is non-zero. */
+    void compose(Image img, Image mask, Point offset);
+
+    /** Warp an image into the canvas, writing only the pixels it covers, per the policy. */
+    void compose(AffineWarp& warp);
+
+    /** How compose(AffineWarp&) treats content already on the canvas. band: seam width in
+	SEAM_BLEND, in pixels. KEEP_NEWEST by default. */
+    void setPolicy(AffineWarp::Policy policy, int band=16);
+
+    AffineWarp::Policy getPolicy();
+
+    /** Number of composes so far. Compose n stamps the pixels it writes with n. */
+    int getComposeCount();
+
+    /** Stamp of each pixel of region r, CV_16U: the compose that last wrote it, or 0 if none
+	has. Stamps stop at 65535. A pixel's age in composes is getComposeCount() less its
+	stamp. */
+    Mat readCoverage(Rect r);
+
+    /** Fraction of region r that's covered. */
+    double coverage(Rect r);
+
+    /** Fraction of the pixels warp would write that are already covered. */
+    double coverage(AffineWarp& warp);
+
+    /** Read a dense copy of region r. Areas without tiles read as zero. */
+    Image read(Rect r);
+
+    /** Read region r (in level 0 coordinates) from a pyramid level. */
+    Image read(Rect r, int level);
+
+    /** Region r of level 0 in level coordinates, rounded outward. */
+    Rect levelRect(Rect r, int level);
+
+    /** Coarsest level at which the whole canvas is at least width pixels wide. */
+    int levelFor(int width);
+
+    int getLevels();
+
+    /** Dense copy of the whole canvas. Expensive; intended for saving. */
+    Image toImage();
+
+    /** Downscaled dense view of the whole canvas, width pixels wide. */
+    Image preview(int width);
+
+    int getTileSize();
+
+    /** Coordinates of the tiles stored at a pyramid level. */
+    void tiles(int level, vector<Point>& out);
+
+    /** Copy of one tile at a pyramid level, or an empty Mat if it isn't stored. */
+    Mat readTile(Point tile, int level);
+
+    /** Persist tiles and bounds to the backing store. */
+    void flush();
+
+  private:
+    /** Rect covered by tile key, in coordinates of the key's level. */
+    Rect tileRect(TileKey key);
+
+    /** Tile coordinate containing pixel coordinate v. */
+    int tileIndex(int v);
+
+    /** Dense copy of region r, in level coordinates. */
+    Mat readLevel(Rect r, int level);
+
+    /** Write src with its top-left at offset, in level coordinates, where mask is set. */
+    void writeLevel(Mat src, Mat mask, Point offset, int level);
+
+    /** Rebuild pyramid tiles under dirty, a region of level 0. */
+    void updatePyramid(Rect dirty);
+
+    /** Coverage stamps of a level 0 tile. Missing stamps are created if create is set or the
+	tile has content, which counts as covered. Returns an empty Mat otherwise. */
+    Mat stampTile(TileKey key, bool create);
+
+    /** Stamp for the current compose. */
+    ushort stamp();
+
+    int levels;
+
+    int tileSize;
+
+    int type;
+
+    Rect area;
+
+    Ptr<TileStore> store;
+
+    /** Coverage stamps of level 0, CV_16U tiles. */
+    Ptr<TileStore> stamps;
+
+    int composed = 0;
+
+    AffineWarp::Policy policy = AffineWarp::Policy::KEEP_NEWEST;
+
+    int band = 16;
+};
+
+#endif
@@ -2,37 +2,12 @@
 #include "config.hpp"
 #include "markers.hpp"
 #include "stitcher.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
 
 using namespace std;
 using namespace cv;
 
-int MAX = 10;
-vector<float> ax, ay, ar;
-void logStats(Matx33f aH) {
-  ax.insert(ax.begin(), aH(0,2));
-  ay.insert(ay.begin(), aH(1,2));
-  ar.insert(ar.begin(), getAngle(aH));
-
-  while (ax.size() > MAX) ax.pop_back();
-  while (ay.size() > MAX) ay.pop_back();
-  while (ar.size() > MAX) ar.pop_back();
-}
-
-void avg(vector<float> list, float& mean, float& range) {
-  int count = list.size();
-  float sum=0;
-  mean=0;
-  float min = 1000000;
-  float max = -1000000;
-  for (int i=0; i<count; i++) {
-    sum += list[i];
-    if (list[i] < min) min = list[i];
-    if (list[i] > max) max = list[i];
-  }
-  mean = sum / (float)count;
-  range = max - min;
-}
-
 int main(int argc, char** argv) {
   Config config;
   Markers markers(config);
@@ -56,44 +31,43 @@ int main(int argc, char** argv) {
   for (int i=0; i<30; i++) cap >> junk;
   config.setv4l(); // Exposure settings don't take unless we read some frames first.
 
-  UMat img, imgCopy, imgProj, lastProj;
+  Image img, imgCopy, imgProj, lastProj;
   int sequence = 0;
   bool doProjection = false;
   bool doStability = false;
   bool drawMarkers = false;
 
-  IncrementalStitcher stitcher(1.0,
-			       IncrementalStitcher::MatchMode::AGGREGATE,
-			       IncrementalStitcher::DetectMethod::DETECT_SURF,
-			       IncrementalStitcher::ExtractMethod::EXTRACT_FREAK);
+  IncrementalStitcher stitcher(config, IncrementalStitcher::MatchMode::AGGREGATE);
+  PoseStats stability; // Frame-to-frame motion over the last 10 frames.
+  int64_t frameId = 0;
   while (true) {
+    Tracer::setFrame(++frameId);
     const int SKIP_FRAMES = 5; // Need to blow away buffered frames.
     for (int i=0; i<SKIP_FRAMES; i++) {
       //cap >> img;
       cap.grab();
       cap.retrieve(img);
       LOG(INFO) << img.cols << " x " << img.rows << endl;
-      vw.write(img.getMat(ACCESS_READ));
+      vw.write(asMat(img));
     }
     img.copyTo(imgCopy);
 
-    UMat imgProj;
+    Image imgProj;
     int status = markers.getArucoOrientedImage(imgCopy, imgProj, drawMarkers,
 					       doProjection || doStability);
     if (doProjection && imgProj.cols > 0) {
       imshow("Projection", imscale(600, imgProj));
     }
-    UMat scaleCopy = imscale(800, imgCopy);
+    Image scaleCopy = imscale(800, imgCopy);
     if (status==Markers::Status::OK &&  doStability && lastProj.cols > 0) {
       Mat R;
       IncrementalStitcher::Status status = stitcher.detectAndMatch(lastProj, imgProj, R);
-      Matx33f H = R;
-      logStats(H);
-      float mx, my, mr;
-      float rx, ry, rr;
-      avg(ax, mx, rx);
-      avg(ay, my, ry);
-      avg(ar, mr, rr);
+      if (status == IncrementalStitcher::Status::OK) {
+	stability.add(R);
+      }
+      float rx = stability.x.range();
+      float ry = stability.y.range();
+      float rr = stability.angle.range();
       //float dx = H(0,2);
       //float dy = H(1,2);
       //float dr = getAngle(H);
@@ -116,12 +90,17 @@ int main(int argc, char** argv) {
     }
     drawText(scaleCopy, "+/- (F/f)ocus  (E/e)xposure  (Z/z)oom", 1.5);
     drawText(scaleCopy, "(C)apture  (P)rojection  (M)arkers  (S)tability");
-    imshow("Capture", scaleCopy);
+    {
+      ScopedTimer timer(Profiler::DISPLAY);
+      imshow("Capture", scaleCopy);
+    }
     lastProj = imgProj;
     
     char key = (char) cv::waitKey(10);
     if (key == 27) {
       break;
+    } else if (key == 't') {
+      Profiler::dump();
     } else if (key == 'p') {
       doProjection = !doProjection;
       if (doProjection) {
@@ -160,4 +139,5 @@ int main(int argc, char** argv) {
       config.savev4l();
     }
   }
+  Profiler::dump();
 }
@@ -26,6 +26,22 @@ Config::Config(string filename) {
     exposure_auto = getInt("exposure_auto", fs);
     exposure_absolute = getInt("exposure_absolute", fs);
     zoom_absolute = getInt("zoom_absolute", fs);
+
+    min_sharpness_ratio = getFloat("min_sharpness_ratio", fs, min_sharpness_ratio);
+    max_clipped = getFloat("max_clipped", fs, max_clipped);
+
+    detect_method = getString("detect_method", fs, detect_method);
+    extract_method = getString("extract_method", fs, extract_method);
+    match_scale = getFloat("match_scale", fs, match_scale);
+
+    grid_cols = getInt("grid_cols", fs, grid_cols, 1);
+    grid_rows = getInt("grid_rows", fs, grid_rows, 1);
+    refine_ecc = getInt("refine_ecc", fs, refine_ecc);
+    nudge_window = getInt("nudge_window", fs, nudge_window, 2);
+
+    canvas_memory_mb = getInt("canvas_memory_mb", fs, canvas_memory_mb);
+    compose_policy = getString("compose_policy", fs, compose_policy);
+    seam_band = getInt("seam_band", fs, seam_band);
     
     getCameraProfile(calibration_file);
 
@@ -49,8 +65,7 @@ void Config::getCameraProfile(string filename) {
   }
 }
 
-float Config::getFloat(string name, FileStorage &fs) {
-  float value;
+float Config::getFloat(string name, FileStorage &fs, float value) {
   if (fs[name].isNone() || fs[name].empty()) {
     LOG(ERROR) << "node \"" << name << "\" does not exist." << endl;
   } else if (fs[name].type() != FileNode::FLOAT) {
@@ -62,8 +77,7 @@ float Config::getFloat(string name, FileStorage &fs) {
   return value;
 }
 
-int Config::getInt(string name, FileStorage &fs) {
-  int value;
+int Config::getInt(string name, FileStorage &fs, int value) {
   if (fs[name].isNone() || fs[name].empty()) {
     LOG(ERROR) << "node \"" << name << "\" does not exist." << endl;
   } else if (fs[name].type() != FileNode::INT) {
@@ -75,8 +89,17 @@ int Config::getInt(string name, FileStorage &fs) {
   return value;
 }
 
-string Config::getString(string name, FileStorage &fs) {
-  string value;
+int Config::getInt(string name, FileStorage &fs, int value, int min) {
+  int read = getInt(name, fs, value);
+  if (read < min) {
+    LOG(ERROR) << "node \"" << name << "\" is less than " << min << ", using " << value
+	       << "." << endl;
+    return value;
+  }
+  return read;
+}
+
+string Config::getString(string name, FileStorage &fs, string value) {
   if (fs[name].isNone() || fs[name].empty()) {
     LOG(ERROR) << "node \"" << name << "\" does not exist." << endl;
   } else if (fs[name].type() != FileNode::STRING) {
@@ -115,6 +138,11 @@ void Config::setv4l() {
 }
 
 void Config::savev4l() {
+  save();
+  setv4l();
+}
+
+void Config::save() {
   FileStorage fs(config_file, FileStorage::WRITE);
   if (fs.isOpened()) {
     fs << "video_source" << video_source;
@@ -133,9 +161,24 @@ void Config::savev4l() {
     fs << "exposure_auto" << exposure_auto;
     fs << "exposure_absolute" << exposure_absolute;
     fs << "zoom_absolute" << zoom_absolute;
+
+    fs << "min_sharpness_ratio" << min_sharpness_ratio;
+    fs << "max_clipped" << max_clipped;
+
+    fs << "detect_method" << detect_method;
+    fs << "extract_method" << extract_method;
+    fs << "match_scale" << match_scale;
+
+    fs << "grid_cols" << grid_cols;
+    fs << "grid_rows" << grid_rows;
+    fs << "refine_ecc" << refine_ecc;
+    fs << "nudge_window" << nudge_window;
+
+    fs << "canvas_memory_mb" << canvas_memory_mb;
+    fs << "compose_policy" << compose_policy;
+    fs << "seam_band" << seam_band;
     fs.release();
   } else {
     LOG(ERROR) << "Failed to load config file...." << endl;
   }
-  setv4l();
 }
@@ -19,6 +19,9 @@ class Config {
 
     void savev4l();
 
+    /** Write every setting back to config_file. */
+    void save();
+
     string config_file;
   
     int video_source = 0;
@@ -49,6 +52,45 @@ class Config {
 
     int zoom_absolute = 100;
 
+    /** Frames less sharp than this fraction of the median of recent frames (variance of the
+	Laplacian at quarter resolution, inside the markerboard) are dropped before marker
+	detection. 0 disables the check. */
+    float min_sharpness_ratio = 0.5;
+
+    /** Frames with more than this fraction of the markerboard black or white are dropped. */
+    float max_clipped = 0.25;
+
+    /** Features the stitcher detects, "surf", "orb" or "sift", and the descriptors it
+	extracts for them, "surf", "orb", "freak" or "brisk". */
+    string detect_method = "surf";
+
+    string extract_method = "freak";
+
+    /** Scale frames are matched at. handicam_regress --tune picks these three for the
+	host. */
+    float match_scale = 1.0;
+
+    /** Cells in match's alignment grid; at least 1 each way. */
+    int grid_cols = 3;
+
+    int grid_rows = 3;
+
+    /** Refine each match against the grid cell to sub-pixel precision (1) or not (0). */
+    int refine_ecc = 1;
+
+    /** Frames nudge mode averages over; at least 2. */
+    int nudge_window = 5;
+
+    /** Max RAM for mapped canvas tiles and their coverage stamps, in MB. */
+    int canvas_memory_mb = 256;
+
+    /** What a frame does where the map already has content: "newest" overwrites it, "fill"
+	leaves it, "seam" blends into it along the frame's edge. */
+    string compose_policy = "newest";
+
+    /** Width of the blended seam with compose_policy "seam", in pixels. */
+    int seam_band = 16;
+
     Mat cameraMatrix;
   
     Mat distCoeffs;
@@ -56,11 +98,14 @@ class Config {
  private:
     void getCameraProfile(string filename);
   
-    float getFloat(string name, FileStorage &fs);
+    float getFloat(string name, FileStorage &fs, float value=0.0);
+
+    int getInt(string name, FileStorage &fs, int value=0);
 
-    int getInt(string name, FileStorage &fs);
+    /** As getInt, keeping value if the node is less than min. */
+    int getInt(string name, FileStorage &fs, int value, int min);
 
-    string getString(string name, FileStorage &fs);
+    string getString(string name, FileStorage &fs, string value="");
 };
 
 #endif
@@ -0,0 +1,52 @@
+#include "framepool.hpp"
+
+using namespace std;
+using namespace cv;
+
+std::atomic<uint64_t> FramePool::allocated(0);
+
+FramePool& FramePool::shared() {
+  static FramePool pool;
+  return pool;
+}
+
+uint64_t FramePool::allocations() {
+  return allocated.load(std::memory_order_relaxed);
+}
+
+Size FramePool::alignSize(Size size, int align) {
+  return Size((size.width + align - 1) / align * align,
+	      (size.height + align - 1) / align * align);
+}
+
+Mat FramePool::getMat(Size size, int type, int align) {
+  Size pooled = alignSize(size, align);
+  Key key = {pooled.height, pooled.width, type};
+  std::lock_guard<std::mutex> guard(lock);
+  vector<Mat>& free = mats[key];
+  // A buffer only the pool references is free.
+  for (int i=0; i<free.size(); i++) {
+    if (free[i].u->refcount == 1) {
+      return free[i](Rect(Point(0, 0), size));
+    }
+  }
+  free.push_back(Mat(pooled, type));
+  allocated.fetch_add(1, std::memory_order_relaxed);
+  return free.back()(Rect(Point(0, 0), size));
+}
+
+UMat FramePool::getUMat(Size size, int type, int align) {
+  Size pooled = alignSize(size, align);
+  Key key = {pooled.height, pooled.width, type};
+  std::lock_guard<std::mutex> guard(lock);
+  vector<UMat>& free = umats[key];
+  // Free if only the pool references it and it isn't mapped to a Mat.
+  for (int i=0; i<free.size(); i++) {
+    if (free[i].u->urefcount == 1 && free[i].u->refcount == 0) {
+      return free[i](Rect(Point(0, 0), size));
+    }
+  }
+  free.push_back(UMat(pooled, type));
+  allocated.fetch_add(1, std::memory_order_relaxed);
+  return free.back()(Rect(Point(0, 0), size));
+}
@@ -0,0 +1,70 @@
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include "util.hpp"
+
+#ifndef FRAME_POOL
+#define FRAME_POOL
+
+using namespace cv;
+using namespace std;
+
+/**
+ * Reusable per-frame image buffers, keyed by size and type. Stages borrow a buffer instead
+ * of allocating one, and it goes back to the pool when the last reference to it is dropped,
+ * normally at the end of the frame. A buffer that's kept longer, like the base image for
+ * the next match, just stays out of the pool until it's released. Once every buffer a frame
+ * needs exists, the loop allocates no more image data.
+ *
+ * Buffers are handed out with undefined contents.
+ */
+class FramePool {
+  public:
+    /** The pool shared by all stages. */
+    static FramePool& shared();
+
+    /** align: round the pooled buffer up to a multiple of align and return a view of size,
+	for sizes that vary a little from frame to frame. */
+    Mat getMat(Size size, int type, int align=1);
+
+    UMat getUMat(Size size, int type, int align=1);
+
+    /** A buffer of the pipeline's Image type. */
+    Image getImage(Size size, int type, int align=1) {
+#ifdef HANDICAM_CPU_MAT
+      return getMat(size, type, align);
+#else
+      return getUMat(size, type, align);
+#endif
+    }
+
+    /** Buffers allocated by all pools so far. Flat in steady state. */
+    static uint64_t allocations();
+
+  private:
+    static Size alignSize(Size size, int align);
+
+    struct Key {
+      int rows;
+
+      int cols;
+
+      int type;
+
+      bool operator<(const Key& k) const {
+	return rows != k.rows ? rows < k.rows : cols != k.cols ? cols < k.cols : type < k.type;
+      }
+    };
+
+    map<Key, vector<Mat> > mats;
+
+    map<Key, vector<UMat> > umats;
+
+    std::mutex lock;
+
+    static std::atomic<uint64_t> allocated;
+};
+
+#endif
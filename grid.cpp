@@ -1,13 +1,5 @@
 #include "grid.hpp"
 
-// TODO: Replace
-void undoScale2(Matx33f H, float s) {
-  H(0,0) = H(0,0) / s;
-  H(0,1) = H(0,1) / s;
-  H(1,0) = H(1,0) / s;
-  H(1,1) = H(1,1) / s;
-}
-
 Grid::Grid(int _grid_cols, int _grid_rows,
 	   float _cell_width, float _cell_height,
 	   float _cell_project_width, float _cell_project_height,
@@ -48,28 +40,37 @@ Point2f Grid::getCellProject(int c) {
   return Point2f(cells[c].x+gx, cells[c].y+gy);
 }
   
-void Grid::drawRectProject(UMat img, int c) {
-  Rect roi = getRoiProject(c);
-  Mat rimg = img.getMat(ACCESS_RW);
-  rectangle(rimg, roi, Scalar(128,128,128), 5);
-  drawGridText(img, roi, names[c], 20.0);
+void Grid::drawRectProject(Image img, int c, Point origin, float scale) {
+  Rect roi = viewRect(getRoiProject(c), origin, scale);
+  {
+    Mat rimg = asMat(img, ACCESS_RW);
+    rectangle(rimg, roi, Scalar(128,128,128), std::max(1, cvRound(5*scale)));
+  }
+  drawGridText(img, roi, names[c], 20.0, scale);
 }
   
-void Grid::drawRect(UMat img, int c) {
-  Rect roi = getRoi(c);
-  Mat rimg = img.getMat(ACCESS_RW);
-  rectangle(rimg, roi, Scalar(0,0,255), 5);
+void Grid::drawRect(Image img, int c, Point origin, float scale) {
+  Rect roi = viewRect(getRoi(c), origin, scale);
+  Mat rimg = asMat(img, ACCESS_RW);
+  rectangle(rimg, roi, Scalar(0,0,255), std::max(1, cvRound(5*scale)));
 }
 
-void Grid::drawGrid(UMat img) {
+void Grid::drawGrid(Image img, Point origin, float scale) {
   for (int i=0; i<cells.size(); i++) {
-    drawRectProject(img, i);
-    drawRect(img, i);
+    drawRectProject(img, i, origin, scale);
+    drawRect(img, i, origin, scale);
   }
 }
 
-void Grid::drawMetrics(UMat img, Matx33f warp,
+void Grid::drawCell(Image cellImg) {
+  drawRectProject(cellImg, selected, getRoi().tl());
+  drawRect(cellImg, selected, getRoi().tl());
+}
+
+void Grid::drawMetrics(Image img, Rect roi, Matx33f warp,
 		       float x, float y, float rx, float ry, float rr, int mode) {
+  FrameScope frame(frameId);
+  ScopedTimer timer(Profiler::GRID_METRICS);
   double t = atan(warp(1,0) / warp(0,0));
   double deg = t * (180/3.1415926535897) * -1;
   char dbuf [7];
@@ -85,7 +86,6 @@ void Grid::drawMetrics(UMat img, Matx33f warp,
   char rrbuf [7];
   sprintf(rrbuf, "%.3f", rr);
 
-  Rect roi = getRoi();
   drawGridTextSmall(img, roi, "Y: " + string(ybuf) + "in +/- " +
 		    string(rybuf) + "in", 1.0, mode);
   drawGridTextSmall(img, roi, "X: " + string(xbuf) + "in +/- " +
@@ -118,119 +118,52 @@ Rect Grid::getRoiProject(int c) {
 }
   
 void Grid::prev() {
-  selected--;
-  if (selected < 0) {
-    selected = cells.size() - 1;
-  }
+  select(selected > 0 ? selected - 1 : cells.size() - 1);
 }
 
 void Grid::next() {
-  selected++;
-  if (selected >= cells.size()) {
-    selected = 0;
-  }
+  select(selected + 1 < cells.size() ? selected + 1 : 0);
 }
 
-void Grid::logStats(Matx33f aH) {
-  ax.insert(ax.begin(), aH(0,2));
-  ay.insert(ay.begin(), aH(1,2));
-  ar.insert(ar.begin(), getAngle(aH));
-  as.insert(as.begin(), getScale(aH));
-
-  while (ax.size() > MAX) ax.pop_back();
-  while (ay.size() > MAX) ay.pop_back();
-  while (ar.size() > MAX) ar.pop_back();
-  while (as.size() > MAX) as.pop_back();
-}
-
-void Grid::avg(vector<float> list, float& mean, float& range) {
-  int count = list.size();
-  float sum=0;
-  mean=0;
-  float min = 1000000;
-  float max = -1000000;
-  for (int i=0; i<count; i++) {
-    sum += list[i];
-    if (list[i] < min) min = list[i];
-    if (list[i] > max) max = list[i];
+void Grid::select(int c) {
+  if (c != selected) {
+    stats.clear();
   }
-  mean = sum / (float)count;
-  range = max - min;
+  selected = c;
+}
+
+void Grid::setWindow(int frames) {
+  stats = PoseStats(std::max(frames, 2));
 }
 
 void Grid::store(Matx33f warp) {
-  logStats(warp);
-  undoScale2(warp, (getScale(warp))); // FYI: destructive
-  warps.insert(warps.begin(), warp);
-  while (warps.size() > MAX) warps.pop_back();
+  FrameScope frame(frameId);
+  ScopedTimer timer(Profiler::GRID_METRICS);
+  stats.add(warp);
 }
 
 Matx33f Grid::avgWarp() {
-  Matx33f aWarp;
-  aWarp(2,2) = 1.0f;
-  int count = warps.size();
-  for (int i=0; i<count; i++) {
-    aWarp(0,0) += warps[i](0,0);
-    aWarp(0,1) += warps[i](0,1);
-    aWarp(0,2) += warps[i](0,2);
-    aWarp(1,0) += warps[i](1,0);
-    aWarp(1,1) += warps[i](1,1);
-    aWarp(1,2) += warps[i](1,2);
-  }
-  aWarp(0,0) /= count;
-  aWarp(0,1) /= count;
-  aWarp(0,2) /= count;
-  aWarp(1,0) /= count;
-  aWarp(1,1) /= count;
-  aWarp(1,2) /= count;
-  return aWarp;
+  return stats.mean();
 }
 
 // In pixels...
-void Grid::showStats(vector<float> list, string name) {
-  float mean, range;
-  avg(list, mean, range);
-  cout << name << ": " << mean << "  " << range << endl;
-}
-
 void Grid::showStats() {
-  showStats(ax, "ax");
-  showStats(ay, "ay");
-  showStats(ar, "ar");
-  showStats(as, "as");
-}
-
-// Scale image to accomodate grid.
-void Grid::handleGridChange(UMat& stitchedImg) {
-  Rect roi = getGridRoi();
-
-  // Handle <0 exceeds-bounds case.
-  if (roi.x < 0 || roi.y < 0) {
-    float dx = roi.x < 0 ? roi.x * -1 : 0;
-    float dy = roi.y < 0 ? roi.y * -1 : 0;
-    LOG(INFO) << "dx: " << dx << "  dy:" << dy << endl; 
-    UMat bufImg = UMat::zeros(stitchedImg.rows+dy, stitchedImg.cols+dx,
-			      stitchedImg.type());
-    Rect croi(Point2f(dx, dy), Size(stitchedImg.cols, stitchedImg.rows));
-    stitchedImg.copyTo(bufImg(croi));
-    bufImg.copyTo(stitchedImg);
-    
-    gx += dx;
-    gy += dy;
-    roi = getGridRoi(); // update roi
-    
-    // Save corresponding changes to image if they impact relative offsets.
-    imwrite("stitched.jpeg", stitchedImg);
-    saveOffsets(gx, gy);
-  }
-    
-  // Handle >cols or >rows exceeds case.
-  if (roi.x + roi.width > stitchedImg.cols || roi.y + roi.height > stitchedImg.rows) {
-    float w = roi.x + roi.width > stitchedImg.cols ? roi.x + roi.width : stitchedImg.cols;
-    float h = roi.y + roi.height > stitchedImg.rows ? roi.y + roi.height : stitchedImg.rows;
-    UMat bufImg = UMat::zeros(h, w, stitchedImg.type());
-    Rect croi(Point2f(0,0), Size(stitchedImg.cols, stitchedImg.rows));
-    stitchedImg.copyTo(bufImg(croi));
-    bufImg.copyTo(stitchedImg);
+  cout << "x: " << stats.x.mean() << " +/- " << stats.x.confidence() << endl;
+  cout << "y: " << stats.y.mean() << " +/- " << stats.y.confidence() << endl;
+  cout << "r: " << stats.angle.mean() << " +/- " << stats.angle.confidence() << endl;
+  cout << "s: " << stats.scale.mean() << " +/- " << stats.scale.confidence() << endl;
+}
+
+// Grow canvas to accomodate grid. Growing is free; no image data is copied.
+bool Grid::handleGridChange(Canvas& canvas) {
+  Rect before = canvas.bounds();
+  canvas.extend(getGridRoi());
+  if (canvas.bounds() != before) {
+    LOG(INFO) << "Canvas bounds: " << canvas.bounds() << endl;
   }
+  return canvas.bounds() != before;
+}
+
+void Grid::setFrameId(int64_t frame) {
+  frameId = frame;
 }
@@ -1,5 +1,8 @@
 #include <opencv2/opencv.hpp>
 #include "util.hpp"
+#include "canvas.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
 
 #ifndef GRID
 #define GRID
@@ -19,9 +22,9 @@ class Grid {
   float cell_project_height = 0.0;
   float cols_per_inch = 0.0;
   float rows_per_inch = 0.0;
-  vector<Matx33f> warps;
-  int MAX = 10;
-  vector<float> ax, ay, ar, as;
+  // Matches of the selected cell over the last few frames, in pixels and degrees.
+  PoseStats stats;
+  int64_t frameId = 0; // Frame being stored and drawn, for tracing.
 
   Grid(int _grid_cols, int _grid_rows,
        float _cell_width, float _cell_height,
@@ -36,13 +39,17 @@ class Grid {
   
   Point2f getCellProject(int c);
   
-  void drawRectProject(UMat img, int c);
+  // Drawing maps grid coordinates to img as (p - origin) * scale.
+  void drawRectProject(Image img, int c, Point origin=Point(0, 0), float scale=1.0);
   
-  void drawRect(UMat img, int c);
+  void drawRect(Image img, int c, Point origin=Point(0, 0), float scale=1.0);
 
-  void drawGrid(UMat img);
+  void drawGrid(Image img, Point origin=Point(0, 0), float scale=1.0);
 
-  void drawMetrics(UMat img, Matx33f warp,
+  // Draw the selected cell's outline onto an image of just that cell.
+  void drawCell(Image cellImg);
+
+  void drawMetrics(Image img, Rect roi, Matx33f warp,
 		   float x, float y, float rx, float ry, float rr, int mode);
 
   Rect getGridRoi();
@@ -57,21 +64,25 @@ class Grid {
 
   void next();
 
-  void logStats(Matx33f aH);
+  // Select cell c. Selecting a different cell starts its statistics afresh.
+  void select(int c);
 
-  void avg(vector<float> list, float& mean, float& range);
+  // Keep statistics over the last frames matched, at least 2.
+  void setWindow(int frames);
 
   void store(Matx33f warp);
 
+  // Mean of the stored warps, rotation averaged as an angle.
   Matx33f avgWarp();
 
-  // In pixels...
-  void showStats(vector<float> list, string name);
-
   void showStats();
 
-  // Scale image to accomodate grid.
-  void handleGridChange(UMat& stitchedImg);
+  // Grow canvas to accomodate grid. Returns true if canvas bounds changed.
+  // Grid coordinates are canvas coordinates, so they don't change as the canvas grows.
+  bool handleGridChange(Canvas& canvas);
+
+  // Tag grid timings with frame, from Source::getFrameId().
+  void setFrameId(int64_t frame);
 };
 
 #endif
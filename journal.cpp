@@ -0,0 +1,157 @@
+#include "journal.hpp"
+#include <sys/stat.h>
+#include <string.h>
+
+using namespace std;
+using namespace cv;
+
+static const char JOURNAL_MAGIC[8] = "HCJRNL";
+static const int JOURNAL_VERSION = 1;
+
+// Decode a batch of journaled frames at the replay scale.
+class DecodeFrames: public ParallelLoopBody {
+  public:
+    DecodeFrames(Journal* _journal, const vector<JournalRecord>& _records, float _scale,
+		 vector<Mat>& _imgs)
+      : journal(_journal), records(_records), scale(_scale), imgs(_imgs) {}
+
+    virtual void operator()(const Range& range) const {
+      for (int i=range.start; i<range.end; i++) {
+	Mat img = journal->readFrame(records[i].seq);
+	if (!img.empty() && scale != 1.0) {
+	  resize(img, imgs[i], Size(img.cols*scale, img.rows*scale), 0, 0, INTER_AREA);
+	} else {
+	  imgs[i] = img;
+	}
+      }
+    }
+
+  private:
+    Journal* journal;
+    const vector<JournalRecord>& records;
+    float scale;
+    vector<Mat>& imgs;
+};
+
+Journal::Journal(const string& _dir, bool truncate) {
+  dir = _dir;
+  mkdir(dir.c_str(), 0755);
+  mkdir((dir + "/frames").c_str(), 0755);
+
+  string journalFile = dir + "/journal.bin";
+  file = fopen(journalFile.c_str(), truncate ? "w+b" : "a+b");
+  if (file == NULL) {
+    LOG(ERROR) << "Failed to open journal: " << journalFile << endl;
+    status = Status::OPEN_ERR;
+    return;
+  }
+
+  Header h;
+  fseek(file, 0, SEEK_END);
+  if (ftell(file) == 0) {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, JOURNAL_MAGIC, sizeof(h.magic));
+    h.version = JOURNAL_VERSION;
+    h.recordSize = sizeof(JournalRecord);
+    fwrite(&h, sizeof(h), 1, file);
+    fflush(file);
+  } else {
+    fseek(file, 0, SEEK_SET);
+    if (fread(&h, sizeof(h), 1, file) != 1 ||
+	memcmp(h.magic, JOURNAL_MAGIC, sizeof(h.magic)) != 0 ||
+	h.version != JOURNAL_VERSION || h.recordSize != sizeof(JournalRecord)) {
+      LOG(ERROR) << "Bad journal header: " << journalFile << endl;
+      status = Status::FORMAT_ERR;
+    }
+  }
+}
+
+Journal::~Journal() {
+  if (file != NULL) {
+    fclose(file);
+  }
+}
+
+Journal::Status Journal::getStatus() {
+  return status;
+}
+
+string Journal::getError(Journal::Status status) {
+  string error = "None";
+  switch(status) {
+  case Journal::Status::OPEN_ERR:
+    error = "Failed to open journal.";
+    break;
+  case Journal::Status::FORMAT_ERR:
+    error = "Journal is from an unsupported version.";
+    break;
+  }
+  return error;
+}
+
+string Journal::framePath(int seq) {
+  return dir + "/frames/" + to_string(seq) + ".jpg";
+}
+
+void Journal::append(const JournalRecord& r, Image frame) {
+  if (status != Status::OK) {
+    return;
+  }
+  // Save the frame first, so a record never refers to a missing frame.
+  if (r.accepted && !imwrite(framePath(r.seq), frame)) {
+    LOG(ERROR) << "Failed to save frame " << r.seq << endl;
+  }
+  fwrite(&r, sizeof(r), 1, file);
+  fflush(file);
+}
+
+void Journal::read(vector<JournalRecord>& out) {
+  out.clear();
+  if (status != Status::OK) {
+    return;
+  }
+  // A torn record at the end is ignored.
+  JournalRecord r;
+  fseek(file, sizeof(Header), SEEK_SET);
+  while (fread(&r, sizeof(r), 1, file) == 1) {
+    out.push_back(r);
+  }
+}
+
+Mat Journal::readFrame(int seq) {
+  return imread(framePath(seq));
+}
+
+int Journal::replay(Canvas& canvas, float scale) {
+  vector<JournalRecord> records, accepted;
+  read(records);
+  for (int i=0; i<records.size(); i++) {
+    if (records[i].accepted) {
+      accepted.push_back(records[i]);
+    }
+  }
+  LOG(INFO) << "Replaying " << accepted.size() << " of " << records.size() << " frames." << endl;
+
+  int count = 0;
+  for (int start=0; start<accepted.size(); start+=batchSize) {
+    int end = std::min(start + batchSize, (int)accepted.size());
+    vector<JournalRecord> batch(accepted.begin() + start, accepted.begin() + end);
+    vector<Mat> imgs(batch.size());
+    parallel_for_(Range(0, batch.size()), DecodeFrames(this, batch, scale, imgs));
+
+    // Later frames overwrite earlier ones, as when stitching, so compose in order.
+    for (int i=0; i<batch.size(); i++) {
+      if (imgs[i].empty()) {
+	LOG(ERROR) << "Missing frame " << batch[i].seq << endl;
+	continue;
+      }
+      // Poses map canvas coordinates to the frame. Rendering at a different scale scales
+      // both the frame and canvas coordinates, so only the translation changes.
+      const float* p = batch[i].pose;
+      AffineWarp warp(imgs[i], Matx23f(p[0], p[1], p[2]*scale, p[3], p[4], p[5]*scale), true);
+      canvas.compose(warp);
+      count++;
+    }
+  }
+  return count;
+}
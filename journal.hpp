@@ -0,0 +1,94 @@
+#include <opencv2/opencv.hpp>
+#include "util.hpp"
+#include "canvas.hpp"
+
+#ifndef JOURNAL
+#define JOURNAL
+
+using namespace cv;
+using namespace std;
+
+/** One frame of a stitching session. */
+struct JournalRecord {
+  int seq;
+
+  /** Non-zero if the frame was composed; its image is saved as frames/<seq>.jpg. */
+  int accepted;
+
+  int markerStatus;
+
+  int stitchStatus;
+
+  /** Capture time, from getTime(). */
+  double time;
+
+  /** Seconds spent acquiring, matching and composing the frame. */
+  float acquireTime;
+
+  float matchTime;
+
+  float composeTime;
+
+  /** Top two rows of the transform from canvas coordinates to the frame. */
+  float pose[6];
+};
+
+/**
+ * Append-only record of a stitching session, in a directory:
+ *   journal.bin  a header, then one fixed-size JournalRecord per frame.
+ *   frames/      the projected image of each accepted frame.
+ *
+ * Records are flushed as they're written, so a crash loses at most the frame in flight.
+ * Replaying composes the accepted frames at their recorded poses without matching.
+ */
+class Journal {
+  public:
+    enum Status {
+      OK = 0,
+      OPEN_ERR = 100,
+      FORMAT_ERR = 101,
+    };
+
+    /** Open the journal in dir. truncate: start a new session. */
+    Journal(const string& dir, bool truncate=false);
+    ~Journal();
+
+    Status getStatus();
+
+    string getError(Status status);
+
+    /** Append r, saving frame if r is accepted. */
+    void append(const JournalRecord& r, Image frame);
+
+    /** All complete records, in order. */
+    void read(vector<JournalRecord>& out);
+
+    Mat readFrame(int seq);
+
+    /**
+     * Compose the accepted frames into canvas at their recorded poses. Frames are decoded
+     * in parallel and warped into the canvas in order. scale: output resolution relative to
+     * the session.
+     */
+    int replay(Canvas& canvas, float scale=1.0);
+
+  private:
+    struct Header {
+      char magic[8];
+      int version;
+      int recordSize;
+    };
+
+    string framePath(int seq);
+
+    Status status = OK;
+
+    string dir;
+
+    FILE* file = NULL;
+
+    /** Frames decoded per replay batch. */
+    int batchSize = 16;
+};
+
+#endif
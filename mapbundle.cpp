@@ -0,0 +1,290 @@
+#include "mapbundle.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+using namespace std;
+using namespace cv;
+
+static const char MANIFEST_MAGIC[8] = "HCMAP";
+static const int MANIFEST_VERSION = 1;
+static const char FEATURES_MAGIC[8] = "HCFEATS";
+static const int FEATURES_VERSION = 1;
+
+// 64-bit FNV-1a.
+static uint64_t hashBytes(const void* data, size_t len, uint64_t h=14695981039346656037ULL) {
+  const unsigned char* p = (const unsigned char*)data;
+  for (size_t i=0; i<len; i++) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static uint64_t hashMat(const Mat& m, uint64_t h) {
+  if (m.empty()) {
+    return h;
+  }
+  Mat d;
+  m.convertTo(d, CV_64F);
+  d = d.clone(); // Continuous.
+  return hashBytes(d.data, d.total() * d.elemSize(), h);
+}
+
+MapBundle::MapBundle(const string& _dir, size_t _memoryCap, bool truncate) {
+  dir = _dir;
+  memoryCap = _memoryCap;
+  memset(&manifest, 0, sizeof(manifest));
+  memcpy(manifest.magic, MANIFEST_MAGIC, sizeof(manifest.magic));
+  manifest.version = MANIFEST_VERSION;
+
+  store = makePtr<MappedTileStore>(dir, memoryCap, 256, CV_8UC3, truncate);
+  if (store->getStatus() != MappedTileStore::Status::OK) {
+    status = store->getStatus() == MappedTileStore::Status::FORMAT_ERR ?
+      Status::FORMAT_ERR : Status::OPEN_ERR;
+    return;
+  }
+
+  string manifestFile = dir + "/manifest.bin";
+  if (truncate) {
+    unlink((dir + "/features.bin").c_str());
+    writeManifest();
+  } else {
+    FILE* f = fopen(manifestFile.c_str(), "rb");
+    if (f == NULL) {
+      writeManifest(); // New bundle, or a tile store from before bundles.
+    } else {
+      Manifest m;
+      bool ok = fread(&m, sizeof(m), 1, f) == 1 &&
+	memcmp(m.magic, MANIFEST_MAGIC, sizeof(m.magic)) == 0 &&
+	m.version == MANIFEST_VERSION;
+      fclose(f);
+      if (!ok) {
+	LOG(ERROR) << "Bad map manifest: " << manifestFile << endl;
+	status = Status::FORMAT_ERR;
+	return;
+      }
+      manifest = m;
+    }
+  }
+
+  offsets = fopen((dir + "/offsets.log").c_str(), "a+b");
+  if (offsets == NULL) {
+    LOG(ERROR) << "Failed to open offsets log in " << dir << endl;
+    status = Status::OPEN_ERR;
+    return;
+  }
+
+  // Drop a record torn by a crash, so later appends stay aligned.
+  fseek(offsets, 0, SEEK_END);
+  long size = ftell(offsets);
+  if (size % sizeof(OffsetRecord) != 0 &&
+      ftruncate(fileno(offsets), size - size % sizeof(OffsetRecord)) != 0) {
+    LOG(ERROR) << "Failed to repair offsets log." << endl;
+  }
+}
+
+MapBundle::~MapBundle() {
+  unmapFeatures();
+  if (offsets != NULL) {
+    fclose(offsets);
+  }
+}
+
+MapBundle::Status MapBundle::getStatus() {
+  return status;
+}
+
+string MapBundle::getError(MapBundle::Status status) {
+  string error = "None";
+  switch(status) {
+  case MapBundle::Status::OPEN_ERR:
+    error = "Failed to open map.";
+    break;
+  case MapBundle::Status::FORMAT_ERR:
+    error = "Map is from an unsupported version.";
+    break;
+  }
+  return error;
+}
+
+Ptr<MappedTileStore> MapBundle::getStore() {
+  return store;
+}
+
+Ptr<MappedTileStore> MapBundle::getStampStore() {
+  if (stamps.empty()) {
+    // Stamps are 2 bytes per pixel of level 0, against about 4 for the tiles and their
+    // pyramid, so they get a third of the cap.
+    size_t stampCap = memoryCap / 3;
+    stamps = makePtr<MappedTileStore>(dir, stampCap, store->getTileSize(), CV_16U, true,
+				      "stamps");
+    store->setMemoryCap(memoryCap - stampCap);
+  }
+  return stamps;
+}
+
+uint64_t MapBundle::getCalibration() {
+  return manifest.calibration;
+}
+
+void MapBundle::setCalibration(uint64_t calibration) {
+  manifest.calibration = calibration;
+  writeManifest();
+}
+
+void MapBundle::writeManifest() {
+  FILE* f = fopen((dir + "/manifest.bin").c_str(), "wb");
+  if (f == NULL || fwrite(&manifest, sizeof(manifest), 1, f) != 1) {
+    LOG(ERROR) << "Failed to write map manifest." << endl;
+  }
+  if (f != NULL) {
+    fclose(f);
+  }
+}
+
+void MapBundle::unmapFeatures() {
+  if (featureAddr != NULL) {
+    munmap(featureAddr, featureBytes);
+    featureAddr = NULL;
+    featureBytes = 0;
+  }
+}
+
+bool MapBundle::loadFeatures(FeatureSet& features) {
+  unmapFeatures();
+  int fd = open((dir + "/features.bin").c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  fstat(fd, &st);
+  if (st.st_size < (off_t)sizeof(FeatureHeader)) {
+    close(fd);
+    return false;
+  }
+  void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map features." << endl;
+    return false;
+  }
+  featureAddr = addr;
+  featureBytes = st.st_size;
+
+  const FeatureHeader* h = (const FeatureHeader*)addr;
+  if (memcmp(h->magic, FEATURES_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != FEATURES_VERSION ||
+      h->calibration != manifest.calibration ||
+      h->scale != features.scale ||
+      h->detectMethod != features.detectMethod ||
+      h->extractMethod != features.extractMethod) {
+    LOG(INFO) << "Map features are stale." << endl;
+    unmapFeatures();
+    return false;
+  }
+
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  size_t recordBytes = (size_t)h->count * sizeof(KeyPointRecord);
+  size_t descOffset = pageSize + (recordBytes + pageSize - 1) / pageSize * pageSize;
+  size_t descBytes = (size_t)h->count * h->descCols * CV_ELEM_SIZE(h->descType);
+  if (descOffset + descBytes > featureBytes) {
+    LOG(ERROR) << "Truncated features file." << endl;
+    unmapFeatures();
+    return false;
+  }
+
+  const KeyPointRecord* r = (const KeyPointRecord*)((char*)addr + pageSize);
+  features.keypoints.resize(h->count);
+  for (int i=0; i<h->count; i++) {
+    features.keypoints[i] = KeyPoint(r[i].x, r[i].y, r[i].size, r[i].angle, r[i].response,
+				     r[i].octave, r[i].classId);
+  }
+  features.descriptors = h->count == 0 ? Mat() :
+    Mat(h->count, h->descCols, h->descType, (char*)addr + descOffset);
+  LOG(INFO) << "Loaded " << h->count << " map features." << endl;
+  return true;
+}
+
+void MapBundle::saveFeatures(const FeatureSet& features) {
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  Mat desc = features.descriptors.isContinuous() ?
+    features.descriptors : features.descriptors.clone();
+
+  FeatureHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, FEATURES_MAGIC, sizeof(h.magic));
+  h.version = FEATURES_VERSION;
+  h.count = features.keypoints.size();
+  h.descType = desc.empty() ? CV_8U : desc.type();
+  h.descCols = desc.cols;
+  h.scale = features.scale;
+  h.detectMethod = features.detectMethod;
+  h.extractMethod = features.extractMethod;
+  h.calibration = manifest.calibration;
+
+  vector<KeyPointRecord> records(h.count);
+  for (int i=0; i<h.count; i++) {
+    const KeyPoint& k = features.keypoints[i];
+    KeyPointRecord r = {k.pt.x, k.pt.y, k.size, k.angle, k.response, k.octave, k.class_id};
+    records[i] = r;
+  }
+  size_t recordBytes = records.size() * sizeof(KeyPointRecord);
+  size_t descOffset = pageSize + (recordBytes + pageSize - 1) / pageSize * pageSize;
+
+  // Write beside the old file and rename, so a crash never leaves a torn file.
+  string file = dir + "/features.bin";
+  string tmpFile = file + ".tmp";
+  int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  size_t descBytes = desc.total() * desc.elemSize();
+  bool ok = fd >= 0 &&
+    ftruncate(fd, descOffset + descBytes) == 0 &&
+    pwrite(fd, &h, sizeof(h), 0) == sizeof(h) &&
+    pwrite(fd, records.data(), recordBytes, pageSize) == (ssize_t)recordBytes &&
+    (descBytes == 0 || pwrite(fd, desc.data, descBytes, descOffset) == (ssize_t)descBytes);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (!ok || rename(tmpFile.c_str(), file.c_str()) != 0) {
+    LOG(ERROR) << "Failed to write map features." << endl;
+  }
+}
+
+bool MapBundle::getOffsets(float& gx, float& gy) {
+  if (offsets == NULL) {
+    return false;
+  }
+  OffsetRecord r;
+  fseek(offsets, 0, SEEK_END);
+  long n = ftell(offsets) / sizeof(r);
+  if (n == 0 || fseek(offsets, (n-1) * sizeof(r), SEEK_SET) != 0 ||
+      fread(&r, sizeof(r), 1, offsets) != 1) {
+    return false;
+  }
+  gx = r.gx;
+  gy = r.gy;
+  return true;
+}
+
+void MapBundle::saveOffsets(float gx, float gy) {
+  if (offsets == NULL) {
+    return;
+  }
+  OffsetRecord r = {gx, gy};
+  // Appends go to the end regardless, but a read followed by a write on the same stream
+  // needs a positioning call in between.
+  fseek(offsets, 0, SEEK_END);
+  if (fwrite(&r, sizeof(r), 1, offsets) != 1) {
+    LOG(ERROR) << "Failed to save offsets." << endl;
+  }
+  fflush(offsets);
+}
+
+uint64_t MapBundle::calibrationHash(const Config& config) {
+  uint64_t h = hashMat(config.cameraMatrix, hashBytes(NULL, 0));
+  h = hashMat(config.distCoeffs, h);
+  int size[] = {config.image_width, config.image_height};
+  return hashBytes(size, sizeof(size), h);
+}
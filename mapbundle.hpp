@@ -0,0 +1,149 @@
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include "util.hpp"
+#include "config.hpp"
+#include "tilestore.hpp"
+
+#ifndef MAP_BUNDLE
+#define MAP_BUNDLE
+
+using namespace cv;
+using namespace std;
+
+/** Keypoints and descriptors for a whole canvas, at a given match scale. */
+struct FeatureSet {
+  /** Match scale the features were detected at. Keypoints are canvas coordinates * scale. */
+  float scale = 1.0;
+
+  int detectMethod = 0;
+
+  int extractMethod = 0;
+
+  vector<KeyPoint> keypoints;
+
+  /** One row per keypoint. May reference the bundle's mapping; valid while it's open. */
+  Mat descriptors;
+};
+
+/**
+ * A stitched map on disk, as a directory:
+ *   manifest.bin  format version and the hash of the calibration the map was stitched with.
+ *   tiles.bin     canvas tiles (see MappedTileStore).
+ *   tiles.idx
+ *   stamps.bin    coverage stamps of this session's composes (see Canvas), started afresh
+ *                 by each session that composes.
+ *   stamps.idx
+ *   features.bin  precomputed features: a one-page header, keypoint records, then the
+ *                 descriptor matrix starting on a page boundary.
+ *   offsets.log   grid origin edits, appended one record per edit. The last record wins.
+ *
+ * Everything is read by mapping rather than decoding, so opening a large map is cheap.
+ */
+class MapBundle {
+  public:
+    enum Status {
+      OK = 0,
+      OPEN_ERR = 100,
+      FORMAT_ERR = 101,
+    };
+
+    /**
+     * Open the bundle in dir, creating it if needed. truncate: discard tiles and features
+     * from a previous stitch. Grid offsets are kept.
+     */
+    MapBundle(const string& dir, size_t memoryCap, bool truncate=false);
+    ~MapBundle();
+
+    Status getStatus();
+
+    string getError(Status status);
+
+    /** Tile store for a Canvas over this map. */
+    Ptr<MappedTileStore> getStore();
+
+    /** Store for a Canvas's coverage stamps, created on first use. It takes its share of
+	memoryCap from the tile store, so the two together stay within the cap. */
+    Ptr<MappedTileStore> getStampStore();
+
+    /** Hash of the calibration the map was stitched with; 0 if unknown. */
+    uint64_t getCalibration();
+
+    void setCalibration(uint64_t calibration);
+
+    /**
+     * Load features matching features.scale, detectMethod and extractMethod and the
+     * bundle's calibration. Returns false if there are none, or they're stale.
+     */
+    bool loadFeatures(FeatureSet& features);
+
+    void saveFeatures(const FeatureSet& features);
+
+    /** Last saved grid origin. Returns false if none was saved. */
+    bool getOffsets(float& gx, float& gy);
+
+    /** Append a grid origin record. */
+    void saveOffsets(float gx, float gy);
+
+    /** Hash of the camera profile and capture size in config. */
+    static uint64_t calibrationHash(const Config& config);
+
+  private:
+    struct Manifest {
+      char magic[8];
+      int version;
+      int reserved;
+      uint64_t calibration;
+    };
+
+    struct FeatureHeader {
+      char magic[8];
+      int version;
+      int count;
+      int descType;
+      int descCols;
+      float scale;
+      int detectMethod;
+      int extractMethod;
+      int reserved;
+      uint64_t calibration;
+    };
+
+    struct KeyPointRecord {
+      float x;
+      float y;
+      float size;
+      float angle;
+      float response;
+      int octave;
+      int classId;
+    };
+
+    struct OffsetRecord {
+      float gx;
+      float gy;
+    };
+
+    void writeManifest();
+
+    void unmapFeatures();
+
+    Status status = OK;
+
+    string dir;
+
+    Manifest manifest;
+
+    size_t memoryCap;
+
+    Ptr<MappedTileStore> store;
+
+    Ptr<MappedTileStore> stamps;
+
+    FILE* offsets = NULL;
+
+    void* featureAddr = NULL;
+
+    size_t featureBytes = 0;
+};
+
+#endif
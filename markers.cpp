@@ -11,6 +11,8 @@ Markers::Markers(Config& config, bool stabilizeMarkers) {
   markerboard_height = config.markerboard_height;
   ratio = markerboard_height / markerboard_width;
   markerboard_offset = config.markerboard_offset;
+  minSharpnessRatio = config.min_sharpness_ratio;
+  maxClipped = config.max_clipped;
 
   dictionary = aruco::getPredefinedDictionary(aruco::DICT_4X4_50);
 
@@ -26,18 +28,85 @@ Markers::Markers(Config& config, bool stabilizeMarkers) {
   }
 }
 
-UMat Markers::getPerspective(UMat img, Point2f srcQuad[]) {
+Image Markers::getPerspective(Image img, Point2f srcQuad[]) {
   Point2f dstQuad[4];
   dstQuad[0] = Point2f(0, 0);
   dstQuad[1] = Point2f(image_width, 0);
   dstQuad[2] = Point2f(image_width, image_width*ratio);
   dstQuad[3] = Point2f(0, image_width*ratio);
+  ScopedTimer timer(Profiler::WARP);
   Mat pmat = getPerspectiveTransform(srcQuad, dstQuad);
-  UMat dst = UMat::zeros(img.rows, img.cols, img.type());
-  warpPerspective(img, dst, pmat, Size(image_width, image_width*ratio), INTER_AREA);
+  // warpPerspective writes every pixel, so the borrowed buffer needn't be cleared.
+  Size size(image_width, image_width*ratio);
+  Image dst = FramePool::shared().getImage(size, img.type());
+  warpPerspective(img, dst, pmat, size, INTER_AREA);
   return crop(dst);
 }
 
+Markers::Status Markers::checkQuality(Image img, const vector<Point2f>& board,
+				       WindowStats& recent) {
+  ScopedTimer timer(Profiler::QUALITY);
+  FramePool& pool = FramePool::shared();
+  Size size(img.cols/4, img.rows/4);
+  Image small = pool.getImage(size, img.type());
+  Mat gray = pool.getMat(size, CV_8U);
+  resize(img, small, size, 0, 0, INTER_AREA);
+  cvtColor(small, gray, CV_BGR2GRAY);
+
+  // Look inside the board, shrunk toward its center to clear the markers at its corners.
+  // The board is from the last frame and in undistorted coordinates, which is close
+  // enough once shrunk.
+  const float BOARD_SHRINK = 0.6;
+  Mat mask = pool.getMat(size, CV_8U);
+  mask.setTo(Scalar(0));
+  if (board.size() == 4) {
+    Point2f center = (board[0] + board[1] + board[2] + board[3]) * 0.25f;
+    Point quad[4];
+    for (int i=0; i<4; i++) {
+      quad[i] = (center + (board[i] - center) * BOARD_SHRINK) * 0.25f;
+    }
+    fillConvexPoly(mask, quad, 4, Scalar(255));
+  }
+  int area = countNonZero(mask);
+  if (area == 0) {
+    mask(Rect(size.width/4, size.height/4, size.width/2, size.height/2)).setTo(Scalar(255));
+    area = countNonZero(mask);
+  }
+
+  // Pixels in the few darkest or brightest levels are clipped.
+  const int CLIP_LEVELS = 5;
+  int clipped = 0;
+  for (int y=0; y<gray.rows; y++) {
+    const uchar* row = gray.ptr(y);
+    const uchar* m = mask.ptr(y);
+    for (int x=0; x<gray.cols; x++) {
+      clipped += m[x] && (row[x] < CLIP_LEVELS || row[x] >= 256 - CLIP_LEVELS);
+    }
+  }
+  if (clipped > maxClipped * area) {
+    return Status::QUALITY_EXPOSURE_ERR;
+  }
+
+  // Sharpness depends on what's in view, so judge it against recent frames, which see
+  // much the same. A few frames are needed before there's anything to judge against.
+  const int MIN_RECENT = 3;
+  double s = sharpness(gray, mask);
+  bool blurred = minSharpnessRatio > 0 && recent.count() >= MIN_RECENT &&
+    s < minSharpnessRatio * recent.median();
+  recent.add(s);
+  if (blurred) {
+    return Status::QUALITY_BLUR_ERR;
+  }
+  return Status::OK;
+}
+
+void Markers::getBoard(vector<Point2f>& board) {
+  board.clear();
+  if (rects.size() >= 4) {
+    board.assign(rects.begin(), rects.begin() + 4);
+  }
+}
+
 void Markers::storeRect(Point2f a, Point2f b, Point2f c, Point2f d) {
   rects.insert(rects.begin(), d);
   rects.insert(rects.begin(), c);
@@ -68,17 +137,21 @@ void Markers::avgRect(Point2f r[]) {
   r[3] = Point2f(dx/(float)rects.size()*4, dy/(float)rects.size()*4);
 }
 
-Markers::Status Markers::getArucoOrientedImage(UMat& img, UMat& imgProj,
+Markers::Status Markers::getArucoOrientedImage(Image& img, Image& imgProj,
 					       bool drawMarkers, bool doProjection) {
   // Undistort image according to camera profile.
-  UMat undist_img;
-  undistort(img, undist_img, cameraMatrix, distCoeffs);
-  undist_img.copyTo(img);
+  Image undist_img = FramePool::shared().getImage(img.size(), img.type());
+  {
+    ScopedTimer timer(Profiler::UNDISTORT);
+    undistort(img, undist_img, cameraMatrix, distCoeffs);
+    undist_img.copyTo(img);
+  }
   
   if (doProjection || drawMarkers) {
     // Detect markers and get locations.
     vector<int> ids;
     vector<vector<Point2f>> corners;
+    ScopedTimer markerTimer(Profiler::MARKER_DETECT);
     aruco::detectMarkers(undist_img, dictionary, corners, ids, params);
 
     // If any markers detected.
@@ -86,6 +159,7 @@ Markers::Status Markers::getArucoOrientedImage(UMat& img, UMat& imgProj,
     if (ids.size() > 0) {
       vector< Vec3d > rvecs, tvecs;
       aruco::estimatePoseSingleMarkers(corners, 1.0, cameraMatrix, distCoeffs, rvecs, tvecs);
+      markerTimer.stop();
 
       if (drawMarkers) {
 	aruco::drawDetectedMarkers(img, corners, ids);
@@ -134,7 +208,7 @@ Markers::Status Markers::getArucoOrientedImage(UMat& img, UMat& imgProj,
   return Status::OK;
 }
 
-UMat Markers::crop(UMat img) {
+Image Markers::crop(Image img) {
   const float border = markerboard_offset;
   const float cols_per_inch = img.cols / markerboard_width;
   const float rows_per_inch = img.rows / markerboard_height;
@@ -163,6 +237,12 @@ string Markers::getError(Markers::Status status) {
   case Markers::Status::ORIENT_TOO_MANY_MARKERS_ERR:
     error = "Reoriented image was bad. Too many markers. Skipping.";
     break;
+  case Markers::Status::QUALITY_BLUR_ERR:
+    error = "Frame is blurred. Hold the camera still. Skipping.";
+    break;
+  case Markers::Status::QUALITY_EXPOSURE_ERR:
+    error = "Frame is badly exposed. Check the exposure setting. Skipping.";
+    break;
   }
   return error;
 }
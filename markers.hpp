@@ -3,6 +3,9 @@
 #include <opencv2/xfeatures2d.hpp>
 #include "util.hpp"
 #include "config.hpp"
+#include "profile.hpp"
+#include "framepool.hpp"
+#include "stats.hpp"
 
 #ifndef MARKERS
 #define MARKERS
@@ -17,6 +20,8 @@ class CV_EXPORTS_W Markers {
       ORIENT_NO_MARKERS_ERR = 100,
       ORIENT_TOO_FEW_MARKERS_ERR = 101,
       ORIENT_TOO_MANY_MARKERS_ERR = 102,
+      QUALITY_BLUR_ERR = 200,
+      QUALITY_EXPOSURE_ERR = 201,
     };
 
     /**
@@ -24,12 +29,29 @@ class CV_EXPORTS_W Markers {
      */
     Markers(Config& config, bool stabilizeMarkers=true);
 
-    UMat getPerspective(UMat img, Point2f srcQuad[]);
+    Image getPerspective(Image img, Point2f srcQuad[]);
 
-    Status getArucoOrientedImage(UMat& img, UMat& imgProj, bool drawMarkers=false, bool doProjection=true);
+    /**
+     * Cheap check, on a quarter-resolution gray copy, that a camera frame is worth
+     * undistorting, projecting and matching: QUALITY_BLUR_ERR if it's motion-blurred or out
+     * of focus, QUALITY_EXPOSURE_ERR if too much of it is black or white.
+     *
+     * Only the work surface counts, not the high-contrast markers: board is the markerboard
+     * from the last frame, as getBoard gives it, and the check looks inside it, clear of
+     * the markers at its corners. With no board, it looks at the middle of the frame.
+     * recent: sharpness of recent frames, which this frame's joins. A frame is blurred if
+     * it's less sharp than a fraction of their median.
+     */
+    Status checkQuality(Image img, const vector<Point2f>& board, WindowStats& recent);
+
+    /** Corners of the markerboard found by the last getArucoOrientedImage, in the frame;
+	empty if it found none. */
+    void getBoard(vector<Point2f>& board);
+
+    Status getArucoOrientedImage(Image& img, Image& imgProj, bool drawMarkers=false, bool doProjection=true);
 
     // Crop Aruco marker fragments out of oriented image.
-    UMat crop(UMat img);
+    Image crop(Image img);
 
     string getError(Status status);
   private:
@@ -51,6 +73,11 @@ class CV_EXPORTS_W Markers {
     
     float ratio;
 
+    /** See Config::min_sharpness_ratio and max_clipped. */
+    float minSharpnessRatio;
+
+    float maxClipped;
+
     int TARGET_FRAMES = 25; // average corners over this many points for stability
 
     std::vector<Point2f> rects;
@@ -1,4 +1,7 @@
 #include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <sstream>
 
 #include "util.hpp"
 #include "markers.hpp"
@@ -6,30 +9,238 @@
 #include "stitcher.hpp"
 #include "source.hpp"
 #include "grid.hpp"
+#include "mapbundle.hpp"
+#include "placeindex.hpp"
+#include "profile.hpp"
 
 using namespace std;
 using namespace cv;
 
-void showError(string error, UMat img) {
+Rect showError(string error, Image img) {
   LOG(ERROR) << error << endl;
-  drawText(img, error, 2);
+  return drawText(img, error, 2);
+}
+
+// Static part of the display: the overview, grayed out except the selected cell in grid
+// mode, with the grid and key help over it. Only rebuilt when the grid changes.
+void drawBackground(Image view, Grid& grid, bool gridMode, Point origin, float scale,
+		    Image& background) {
+  view.copyTo(background);
+  if (gridMode) {
+    Rect roi = viewRect(grid.getRoi(), origin, scale) & Rect(0, 0, view.cols, view.rows);
+    Image viewGray;
+    cvtColor(view, viewGray, CV_RGB2GRAY);
+    cvtColor(viewGray, background, CV_GRAY2RGB);
+    view(roi).copyTo(background(roi));
+  }
+  grid.drawGrid(background, origin, scale);
+  drawText(background, "(G)rid Next  (A)uto Cell  (W)hole Map  (N)udge  (M)ove Mode");
+}
+
+// Grow dirty to cover r, clipped to the display.
+void addDirty(Rect& dirty, Rect r, Size size) {
+  r &= Rect(Point(0, 0), size);
+  if (r.area() == 0) {
+    return;
+  }
+  dirty = dirty.area() == 0 ? r : (dirty | r);
+}
+
+// Detect features over the whole canvas a block at a time, so the full-resolution map is
+// never in memory at once. Blocks are padded so detection near block edges sees the same
+// neighbourhood it would in one pass.
+void detectCanvasFeatures(Canvas& canvas, IncrementalStitcher& stitcher,
+			  FeatureSet& features) {
+  const int block = 1024;
+  float s = features.scale;
+  int pad = cvCeil(128 / s);
+  Rect b = canvas.bounds();
+  Mat descriptors;
+  features.keypoints.clear();
+  for (int y=b.y; y<b.y + b.height; y+=block) {
+    for (int x=b.x; x<b.x + b.width; x+=block) {
+      Rect core = Rect(x, y, block, block) & b;
+      Rect padded(core.x - pad, core.y - pad, core.width + pad*2, core.height + pad*2);
+      detail::ImageFeatures f;
+      stitcher.detectFeatures(canvas.read(padded), f);
+      Mat d = f.descriptors.getMat(ACCESS_READ);
+      for (int i=0; i<f.keypoints.size(); i++) {
+	Point2f p(f.keypoints[i].pt.x / s + padded.x, f.keypoints[i].pt.y / s + padded.y);
+	if (p.x < core.x || p.y < core.y ||
+	    p.x >= core.x + core.width || p.y >= core.y + core.height) {
+	  continue; // Belongs to a neighbouring block.
+	}
+	KeyPoint k = f.keypoints[i];
+	k.pt = Point2f(p.x * s, p.y * s);
+	features.keypoints.push_back(k);
+	descriptors.push_back(d.row(i));
+      }
+    }
+  }
+  features.descriptors = descriptors;
+  LOG(INFO) << "Detected " << features.keypoints.size() << " map features." << endl;
+}
+
+// Base features for roi, in roi coordinates at match scale.
+void selectFeatures(const FeatureSet& features, Rect roi, detail::ImageFeatures& out) {
+  float s = features.scale;
+  float x0 = roi.x * s, y0 = roi.y * s;
+  float x1 = (roi.x + roi.width) * s, y1 = (roi.y + roi.height) * s;
+  Mat descriptors;
+  out.img_idx = 0;
+  out.img_size = Size(cvRound(x1 - x0), cvRound(y1 - y0));
+  out.keypoints.clear();
+  for (int i=0; i<features.keypoints.size(); i++) {
+    KeyPoint k = features.keypoints[i];
+    if (k.pt.x < x0 || k.pt.y < y0 || k.pt.x >= x1 || k.pt.y >= y1) {
+      continue;
+    }
+    k.pt = Point2f(k.pt.x - x0, k.pt.y - y0);
+    out.keypoints.push_back(k);
+    descriptors.push_back(features.descriptors.row(i));
+  }
+  descriptors.copyTo(out.descriptors);
+}
+
+// Grid cells as places for the place index.
+void setCellPlaces(Grid& grid, PlaceIndex& places) {
+  vector<Rect> cells;
+  for (int c=0; c<grid.cells.size(); c++) {
+    cells.push_back(grid.getRoi(c));
+  }
+  places.setPlaces(cells);
+}
+
+// The grid cell img shows, found by verifying only the cells the place index ranks
+// highest, other than the selected one. -1 if none of them matches.
+int relocalize(IncrementalStitcher& stitcher, PlaceIndex& places, const FeatureSet& features,
+	       Grid& grid, Image img) {
+  const int CANDIDATES = 3;
+  detail::ImageFeatures f;
+  stitcher.detectFeatures(img, f);
+  vector<int> ranked;
+  places.query(f.descriptors.getMat(ACCESS_READ), CANDIDATES + 1, ranked);
+  int tried = 0;
+  for (int i=0; i<ranked.size() && tried<CANDIDATES; i++) {
+    if (ranked[i] == grid.selected) {
+      continue;
+    }
+    tried++;
+    detail::ImageFeatures cellFeatures;
+    selectFeatures(features, grid.getRoi(ranked[i]), cellFeatures);
+    Mat R;
+    if (stitcher.verifyMatch(cellFeatures, f, R) == IncrementalStitcher::Status::OK) {
+      return ranked[i];
+    }
+  }
+  return -1;
+}
+
+// Scores a frame against cells in parallel, in the given order, and skips the rest once a
+// cell matches confidently. Cells that don't match keep confidence 0.
+class ScoreCells: public ParallelLoopBody {
+  public:
+    ScoreCells(const IncrementalStitcher& _stitcher,
+	       const vector<detail::ImageFeatures>& _cells, const vector<int>& _order,
+	       const detail::ImageFeatures& _frame, double _confident,
+	       vector<double>& _confidence, vector<Mat>& _warps, std::atomic<bool>& _done)
+      : stitcher(_stitcher), cells(_cells), order(_order), frame(_frame),
+	confident(_confident), confidence(_confidence), warps(_warps), done(_done) {}
+
+    virtual void operator()(const Range& range) const {
+      for (int i=range.start; i<range.end && !done.load(); i++) {
+	int c = order[i];
+	double conf = 0;
+	if (stitcher.verifyMatch(cells[c], frame, warps[c], &conf) ==
+	    IncrementalStitcher::Status::OK) {
+	  confidence[c] = conf;
+	  if (conf >= confident) {
+	    done = true;
+	  }
+	}
+      }
+    }
+
+  private:
+    const IncrementalStitcher& stitcher;
+    const vector<detail::ImageFeatures>& cells;
+    const vector<int>& order;
+    const detail::ImageFeatures& frame;
+    double confident;
+    vector<double>& confidence;
+    vector<Mat>& warps;
+    std::atomic<bool>& done;
+};
+
+// Every cell's base features, as selectFeatures gives them.
+void selectCellFeatures(Grid& grid, const FeatureSet& features,
+			vector<detail::ImageFeatures>& cells) {
+  cells.resize(grid.cells.size());
+  for (int c=0; c<grid.cells.size(); c++) {
+    selectFeatures(features, grid.getRoi(c), cells[c]);
+  }
+}
+
+// Match img against every cell at once and return the most confident match, or -1 if no
+// cell matches. Cells closest to near, where the last frame was on the canvas, go first, so
+// the likely cell is usually scored before a confident match stops the rest.
+int bestCell(IncrementalStitcher& stitcher, const vector<detail::ImageFeatures>& cells,
+	     Grid& grid, Image img, Point2f near, Mat& R) {
+  const double CONFIDENT = 2.0;
+  detail::ImageFeatures f;
+  stitcher.detectFeatures(img, f);
+
+  vector<pair<float, int> > byDistance;
+  for (int c=0; c<cells.size(); c++) {
+    Rect roi = grid.getRoi(c);
+    Point2f center(roi.x + roi.width/2.0f, roi.y + roi.height/2.0f);
+    byDistance.push_back(make_pair((float)norm(center - near), c));
+  }
+  sort(byDistance.begin(), byDistance.end());
+  vector<int> order;
+  for (int i=0; i<byDistance.size(); i++) {
+    order.push_back(byDistance[i].second);
+  }
+
+  vector<double> confidence(cells.size(), 0);
+  vector<Mat> warps(cells.size());
+  std::atomic<bool> done(false);
+  parallel_for_(Range(0, order.size()),
+		ScoreCells(stitcher, cells, order, f, CONFIDENT, confidence, warps, done),
+		order.size());
+
+  int best = -1;
+  stringstream scores;
+  for (int c=0; c<cells.size(); c++) {
+    scores << " " << grid.names[c] << ":" << confidence[c];
+    if (confidence[c] > 0 && (best < 0 || confidence[c] > confidence[best])) {
+      best = c;
+    }
+  }
+  LOG(INFO) << "Cell confidence:" << scores.str() << endl;
+  if (best >= 0) {
+    R = warps[best];
+  }
+  return best;
 }
 
 class Projector {
   public:
   Projector(Matx33f _warp, float _borderx, float _bordery,
-	    float _cpi, float _rpi) {
+	    float _cpi, float _rpi, Point _origin=Point(0, 0), float _scale=1.0) {
     warp = _warp;
     borderx = _borderx;
     bordery = _bordery;
     cpi = _cpi;
     rpi = _rpi;
+    origin = _origin;
+    scale = _scale;
   }
   Point2f pt(float x, float y, float bx=0.0f, float by=0.0f) {
     Point2f pt = Point2f(x+bx*borderx*cpi,
     			 y+by*bordery*rpi);
     Point3f hi = warp.inv() * pt;
-    Point2f po(hi.x, hi.y);
+    Point2f po((hi.x - origin.x) * scale, (hi.y - origin.y) * scale);
     return po;
   }
   Matx33f warp;
@@ -37,6 +248,8 @@ class Projector {
   float bordery;
   float cpi;
   float rpi;
+  Point origin;
+  float scale;
 };
 
 int main( int argc, char** argv ) {
@@ -52,6 +265,7 @@ int main( int argc, char** argv ) {
   moveWindow("Camera", 800, 20);
 
   string filename = "stitched.jpeg";
+  string mapname = "stitched.map";
 
   Source *source;
   if (argc==1) {
@@ -78,14 +292,57 @@ int main( int argc, char** argv ) {
     source = new VideoSource(cap);
   }
   
-  UMat stitchedImg = imread(filename).getUMat(ACCESS_READ);
-  imshow("Stitched Image", imscale(800, stitchedImg));
+  // Open the map bundle, importing the stitched image on first use. Tiles are mapped,
+  // not decoded, and only the tiles under the cells we look at are paged in.
+  size_t canvasCap = (size_t)config.canvas_memory_mb << 20;
+  uint64_t calibration = MapBundle::calibrationHash(config);
+  Ptr<MapBundle> bundle = makePtr<MapBundle>(mapname, canvasCap);
+  if (bundle->getStatus() == MapBundle::Status::FORMAT_ERR) {
+    // Map from an older version; rebuild it from the stitched image.
+    LOG(INFO) << "Rebuilding " << mapname << endl;
+    bundle.release();
+    bundle = makePtr<MapBundle>(mapname, canvasCap, true);
+  }
+  if (bundle->getStatus() != MapBundle::Status::OK) {
+    LOG(ERROR) << bundle->getError(bundle->getStatus()) << endl;
+    return -1;
+  }
+  Ptr<MappedTileStore> stamps = bundle->getStampStore();
+  if (stamps->getStatus() != MappedTileStore::Status::OK) {
+    return -1; // Logged by the store.
+  }
+  Canvas canvas(bundle->getStore(), stamps);
+  if (canvas.empty()) {
+    Mat stitchedImg = imread(filename);
+    if (!stitchedImg.cols) {
+      LOG(ERROR) << "Bad file: " << filename << endl;
+      return -1;
+    }
+    canvas.compose(asImage(stitchedImg), Point(0, 0));
+    canvas.flush();
+    bundle->setCalibration(calibration);
+  } else if (bundle->getCalibration() != calibration) {
+    LOG(ERROR) << "Map was stitched with a different camera calibration." << endl;
+  }
 
-  float matchScale = 1.0;
-  IncrementalStitcher stitcher(matchScale,
-			       IncrementalStitcher::MatchMode::AGGREGATE,
-			       IncrementalStitcher::DetectMethod::DETECT_SURF,
-			       IncrementalStitcher::ExtractMethod::EXTRACT_FREAK);
+  // Overview of the map at display scale.
+  const int VIEW_WIDTH = 800;
+  Image view = canvas.preview(VIEW_WIDTH);
+  Point viewOrigin = canvas.bounds().tl();
+  float viewScale = (float)VIEW_WIDTH / canvas.bounds().width;
+  imshow("Stitched Image", view);
+
+  IncrementalStitcher stitcher(config, IncrementalStitcher::MatchMode::AGGREGATE);
+
+  // Map features are detected once and kept in the bundle.
+  FeatureSet mapFeatures;
+  mapFeatures.scale = stitcher.getMatchScale();
+  mapFeatures.detectMethod = stitcher.getDetectMethod();
+  mapFeatures.extractMethod = stitcher.getExtractMethod();
+  if (!bundle->loadFeatures(mapFeatures)) {
+    detectCanvasFeatures(canvas, stitcher, mapFeatures);
+    bundle->saveFeatures(mapFeatures);
+  }
 
   const float markerboard_width_actual = (config.markerboard_width -
 					  config.markerboard_offset*2.0f);
@@ -96,60 +353,159 @@ int main( int argc, char** argv ) {
   float rows_per_inch = 186.0;
 
   // Burn a frame to set cpi & rpi.
-  UMat img_base;
+  Image img_base;
   source->nextImage(markers, img_base);
   cols_per_inch = (float)img_base.cols / markerboard_width_actual;
   rows_per_inch = (float)img_base.rows / markerboard_height_actual;
   LOG(INFO) << "cpi: " << cols_per_inch << endl;
   LOG(INFO) << "rpi: " << rows_per_inch << endl;
   
-  Grid grid(3, 3,
+  Grid grid(config.grid_cols, config.grid_rows,
 	    markerboard_width_actual,
 	    markerboard_height_actual,
 	    config.markerboard_project_width,
 	    config.markerboard_project_height,
 	    cols_per_inch, rows_per_inch);
 
+  grid.setWindow(config.nudge_window);
   grid.gx = 100.0;
   grid.gy = img_base.rows-100;
-  getOffsets(grid.gx, grid.gy); // Read saved offsets from file.
-  grid.handleGridChange(stitchedImg);
+  if (!bundle->getOffsets(grid.gx, grid.gy)) {
+    getOffsets(grid.gx, grid.gy); // Offsets saved before map bundles.
+  }
+  if (grid.handleGridChange(canvas)) {
+    view = canvas.preview(VIEW_WIDTH);
+    viewOrigin = canvas.bounds().tl();
+    viewScale = (float)VIEW_WIDTH / canvas.bounds().width;
+  }
+
+  // When the selected cell stops matching, look the frame up in the whole map and switch
+  // to the cell it shows, instead of cycling cells by hand.
+  PlaceIndex places(mapFeatures);
+  setCellPlaces(grid, places);
+  const int RELOCALIZE_AFTER = 3; // Failed matches in a row.
+  int failures = 0;
+
+  // In auto mode every cell is scored each frame and the best one is selected.
+  vector<detail::ImageFeatures> allCellFeatures;
+  selectCellFeatures(grid, mapFeatures, allCellFeatures);
+  Point2f lastCenter = grid.getRoi().tl();
   
   bool gridMode  = true;
+  bool autoMode = false;
   bool nudgeMode  = false;
   bool moveMode = false;
 
+  // Offset of the last grid match, and whether its refinement was within tolerance.
+  Point2f lastOffset;
+  bool lastPrecise = false;
+
+  // The display is the cached background plus a per-frame overlay. Each frame only the
+  // region the previous overlay touched is restored from the background.
+  Image background, viewCopy;
+  Rect viewRoi;
+  Image cellBase;
+  detail::ImageFeatures cellFeatures;
+  Rect dirty;
+  bool redraw = true;
+
   while (!source->done()) {
-    UMat img2, cell, stitchedCopy;
-    stitchedImg.copyTo(stitchedCopy);
-    
-    if (gridMode) {
-      // For grid mode, gray out base image and replace roi with color.
-      UMat stitchedGray;
-      cvtColor(stitchedCopy, stitchedGray, CV_RGB2GRAY);
-      cvtColor(stitchedGray, stitchedCopy, CV_GRAY2RGB);
-      Rect roi = grid.getRoi();
-      stitchedImg(roi).copyTo(stitchedCopy(roi));
-    }
-    grid.drawGrid(stitchedCopy);
-      
+    Image img2;
+    if (redraw) {
+      ScopedTimer timer(Profiler::DISPLAY);
+      drawBackground(view, grid, gridMode, viewOrigin, viewScale, background);
+      background.copyTo(viewCopy);
+      timer.stop();
+      viewRoi = viewRect(grid.getRoi(), viewOrigin, viewScale) &
+	Rect(0, 0, viewCopy.cols, viewCopy.rows);
+
+      // Only the selected cell is read at full resolution.
+      cellBase = canvas.read(grid.getRoi());
+      selectFeatures(mapFeatures, grid.getRoi(), cellFeatures);
+      redraw = false;
+    } else if (dirty.area() > 0) {
+      background(dirty).copyTo(viewCopy(dirty));
+    }
+    dirty = Rect();
+
+    Image cell;
+    cellBase.copyTo(cell);
+
     // If we're in move mode, skip.
     if (!moveMode) {
       Markers::Status istatus = source->nextImage(markers, img2);
+      stitcher.setFrameId(source->getFrameId());
+      stitcher.setFrameTime(source->getFrameTime());
+      grid.setFrameId(source->getFrameId());
 
       if (istatus == 0) {
       	Mat R;
 	IncrementalStitcher::Status status;
+	int level = 0;
+	Rect levelRoi;
 	if (!gridMode) {
-	  status = stitcher.detectAndMatch(stitchedCopy, img2, R);
+	  // Match the whole map at the pyramid level nearest the frame size. The frame is
+	  // shrunk to the same level, so the match has no scale for matchPair to reject.
+	  level = canvas.levelFor(img2.cols);
+	  levelRoi = canvas.levelRect(canvas.bounds(), level);
+	  float d = 1 << level;
+	  Image levelImg = img2;
+	  if (level > 0) {
+	    resize(img2, levelImg, Size(cvRound(img2.cols/d), cvRound(img2.rows/d)), 0, 0,
+		   INTER_AREA);
+	  }
+	  status = stitcher.detectAndMatch(canvas.read(canvas.bounds(), level), levelImg, R);
+	} else if (autoMode) {
+	  int c = bestCell(stitcher, allCellFeatures, grid, img2, lastCenter, R);
+	  status = c >= 0 ? IncrementalStitcher::Status::OK :
+	    IncrementalStitcher::Status::TOO_FEW_MATCHES_ERR;
+	  if (c >= 0 && c != grid.selected) {
+	    LOG(INFO) << "Selected " << grid.names[c] << endl;
+	    grid.select(c);
+	    cellBase = canvas.read(grid.getRoi());
+	    cellBase.copyTo(cell);
+	    selectFeatures(mapFeatures, grid.getRoi(), cellFeatures);
+	    viewRoi = viewRect(grid.getRoi(), viewOrigin, viewScale) &
+	      Rect(0, 0, viewCopy.cols, viewCopy.rows);
+	    redraw = true;
+	  }
 	} else {
-	  status = stitcher.detectAndMatch(stitchedImg(grid.getRoi()), img2, R);
+	  status = stitcher.detectAndMatch(cellFeatures, img2, R);
+	}
+
+	if (status == IncrementalStitcher::Status::OK) {
+	  // Transforms are at match scale; only the translation differs at full resolution.
+	  R.at<float>(0,2) /= stitcher.getMatchScale();
+	  R.at<float>(1,2) /= stitcher.getMatchScale();
+	}
+
+	// Refine the feature match against the cell's pixels, for a sub-pixel offset and an
+	// estimate of its error from this frame alone.
+	double frameError = INFINITY;
+	if (status == IncrementalStitcher::Status::OK && gridMode && config.refine_ecc) {
+	  Mat refined = R.clone();
+	  if (stitcher.refine(cellBase, img2, refined, frameError) ==
+	      IncrementalStitcher::Status::OK) {
+	    R = refined;
+	  } else {
+	    frameError = INFINITY;
+	  }
 	}
 	
 	if (status == IncrementalStitcher::Status::OK) {
 	  Matx33f warp = R;
 	  Matx33f useWarp = warp;
-	  if (gridMode) {
+	  if (!gridMode) {
+	    // Matched a pyramid level of the whole map against the frame at the same level;
+	    // bring canvas coordinates to that level first, and the match back up to the
+	    // full-resolution frame after.
+	    float d = 1 << level;
+	    useWarp = Matx33f(d, 0, 0, 0, d, 0, 0, 0, 1) * warp *
+	      Matx33f(1/d, 0, -levelRoi.x, 0, 1/d, -levelRoi.y, 0, 0, 1);
+	  } else {
+	    Point3f center = warp.inv() * Point3f(img2.cols/2.0f, img2.rows/2.0f, 1);
+	    lastCenter = Point2f(center.x, center.y) + Point2f(grid.getRoi().tl());
+
 	    // Offset by grid offset.
 	    warp(0,2) -= grid.getCell().x;
 	    warp(1,2) -= grid.getCell().y;
@@ -160,16 +516,53 @@ int main( int argc, char** argv ) {
 	      useWarp = warp;
 	    }
 
+	    // Outside nudge mode, show this frame's offset and the recent jitter. In nudge
+	    // mode, show the mean offset without outliers and its 95% confidence interval, taken
+	    // from the MAD of the frames it keeps, which narrows as frames agree, or this
+	    // frame's refined offset if it's more precise on its own.
+	    // The metrics turn from yellow to green once the window is within tolerance, or two
+	    // frames in a row refine within tolerance and agree. One frame alone never does.
+	    const float TOLERANCE = 0.01 * cols_per_inch; // 0.01 inches.
+	    const float ANGLE_TOLERANCE = 0.05; // Degrees.
 	    float x = R.at<float>(0,2);
 	    float y = R.at<float>(1,2);
-	    float mx, my, mr, rx, ry, rr;
-	    grid.avg(grid.ax, mx, rx);
-	    grid.avg(grid.ay, my, ry);
-	    grid.avg(grid.ar, mr, rr);
-
-	    grid.drawMetrics(stitchedCopy, useWarp, x/cols_per_inch, y/cols_per_inch,
-			     rx/cols_per_inch, ry/rows_per_inch, rr, nudgeMode);
-	    imshow("Cell", imscale(600, stitchedCopy(grid.getRoi())));
+	    bool precise = 1.96 * frameError <= TOLERANCE;
+	    bool agreed = precise && lastPrecise && fabs(x - lastOffset.x) <= TOLERANCE &&
+	      fabs(y - lastOffset.y) <= TOLERANCE;
+	    lastOffset = Point2f(x, y);
+	    lastPrecise = precise;
+	    float rx = grid.stats.x.range();
+	    float ry = grid.stats.y.range();
+	    float rr = grid.stats.angle.range();
+	    int mode = nudgeMode;
+	    if (nudgeMode) {
+	      x = grid.stats.x.robustMean() + grid.getCell().x;
+	      y = grid.stats.y.robustMean() + grid.getCell().y;
+	      rx = grid.stats.x.robustConfidence();
+	      ry = grid.stats.y.robustConfidence();
+	      rr = grid.stats.angle.confidence();
+	      bool settled = std::max(rx, ry) <= TOLERANCE;
+	      if (1.96 * frameError < std::max(rx, ry)) {
+		x = lastOffset.x;
+		y = lastOffset.y;
+		rx = ry = 1.96 * frameError;
+		useWarp = warp;
+	      }
+	      if ((settled || agreed) && rr <= ANGLE_TOLERANCE) {
+		mode = 0;
+	      }
+	    }
+
+	    grid.drawCell(cell);
+	    grid.drawMetrics(cell, Rect(0, 0, cell.cols, cell.rows), useWarp,
+			     x/cols_per_inch, y/cols_per_inch,
+			     rx/cols_per_inch, ry/rows_per_inch, rr, mode);
+	    grid.drawMetrics(viewCopy, viewRoi, useWarp, x/cols_per_inch, y/cols_per_inch,
+			     rx/cols_per_inch, ry/rows_per_inch, rr, mode);
+	    // Metrics text is centered on the cell and may overhang it sideways.
+	    addDirty(dirty, Rect(0, viewRoi.y, viewCopy.cols, viewRoi.height + 4),
+		     viewCopy.size());
+	    imshow("Cell", imscale(600, cell));
 	  }
 
 	  imshow("Camera", imscale(600, img2));
@@ -179,7 +572,8 @@ int main( int argc, char** argv ) {
 				 (markerboard_width_actual))/2.0f;
 	  const float bordery = (config.markerboard_project_height -
 				 (markerboard_height_actual))/2.0f;
-	  Projector p(useWarp, borderx, bordery, cols_per_inch, rows_per_inch);
+	  Projector p(useWarp, borderx, bordery, cols_per_inch, rows_per_inch,
+		      viewOrigin, viewScale);
 	  Point2f p0  = p.pt(0.0f, 0.0f);
 	  Point2f p1  = p.pt(img2.cols, 0.0f);
 	  Point2f p2  = p.pt(img2.cols, img2.rows);
@@ -190,35 +584,66 @@ int main( int argc, char** argv ) {
 	  Point2f p2b = p.pt(img2.cols, img2.rows, 1.0, 1.0);
 	  Point2f p3b = p.pt(0.0f, img2.rows, -1.0, 1.0);
 	  
-	  line(stitchedCopy, p0, p1, Scalar(255, 0, 0), 3, CV_AA);
-	  line(stitchedCopy, p1, p2, Scalar(255, 0, 0), 3, CV_AA);
-	  line(stitchedCopy, p2, p3, Scalar(255, 0, 0), 3, CV_AA);
-	  line(stitchedCopy, p3, p0, Scalar(255, 0, 0), 3, CV_AA);
+	  line(viewCopy, p0, p1, Scalar(255, 0, 0), 1, CV_AA);
+	  line(viewCopy, p1, p2, Scalar(255, 0, 0), 1, CV_AA);
+	  line(viewCopy, p2, p3, Scalar(255, 0, 0), 1, CV_AA);
+	  line(viewCopy, p3, p0, Scalar(255, 0, 0), 1, CV_AA);
 	  
-	  line(stitchedCopy, p0b, p1b, Scalar(255, 0, 0), 3, CV_AA);
-	  line(stitchedCopy, p1b, p2b, Scalar(255, 0, 0), 3, CV_AA);
-	  line(stitchedCopy, p2b, p3b, Scalar(255, 0, 0), 3, CV_AA);
-	  line(stitchedCopy, p3b, p0b, Scalar(255, 0, 0), 3, CV_AA);	
+	  line(viewCopy, p0b, p1b, Scalar(255, 0, 0), 1, CV_AA);
+	  line(viewCopy, p1b, p2b, Scalar(255, 0, 0), 1, CV_AA);
+	  line(viewCopy, p2b, p3b, Scalar(255, 0, 0), 1, CV_AA);
+	  line(viewCopy, p3b, p0b, Scalar(255, 0, 0), 1, CV_AA);
+
+	  vector<Point2f> corners = {p0, p1, p2, p3, p0b, p1b, p2b, p3b};
+	  Rect lines = boundingRect(corners);
+	  addDirty(dirty, Rect(lines.x - 2, lines.y - 2, lines.width + 4, lines.height + 4),
+		   viewCopy.size());
 	} else {
-	  showError(stitcher.getError(status), stitchedCopy);
+	  addDirty(dirty, showError(stitcher.getError(status), viewCopy), viewCopy.size());
+	  lastPrecise = false;
+	}
+
+	failures = status == IncrementalStitcher::Status::OK ? 0 : failures + 1;
+	if (gridMode && !autoMode && failures >= RELOCALIZE_AFTER) {
+	  failures = 0;
+	  int c = relocalize(stitcher, places, mapFeatures, grid, img2);
+	  if (c >= 0) {
+	    LOG(INFO) << "Relocalized to " << grid.names[c] << endl;
+	    grid.select(c);
+	    stitcher.resetMotion();
+	    redraw = true;
+	  }
 	}
       } else {
-	showError(markers.getError(istatus), stitchedCopy);
+	addDirty(dirty, showError(markers.getError(istatus), viewCopy), viewCopy.size());
       }
     }
 
-    UMat scaleCopy = imscale(800, stitchedCopy);
-    if (stitchedCopy.cols > 0) {
-      drawText(scaleCopy, "(G)rid Next  (N)udge  (M)ove Mode");
-      imshow("Stitched Image", scaleCopy);
+    if (viewCopy.cols > 0) {
+      ScopedTimer timer(Profiler::DISPLAY);
+      imshow("Stitched Image", viewCopy);
     }
 
     // Include a short pause for any drawing to catch up.
     key = waitKey(10);
     if (key == 27) break;
-    if (key == 'g') grid.next();
+    if (key == 'g') {
+      grid.next();
+      stitcher.resetMotion(); // New base image; old poses don't apply.
+      redraw = true;
+    }
+    if (key == 'a') {
+      autoMode = !autoMode;
+      stitcher.resetMotion();
+    }
+    if (key == 'w') {
+      gridMode = !gridMode;
+      stitcher.resetMotion(); // Whole map and cell have different bases.
+      redraw = true;
+    }
     if (key == 'm') moveMode=!moveMode;
     if (key == 'n') nudgeMode = !nudgeMode;
+    if (key == 't') Profiler::dump();
     if (moveMode) {
       bool changed = false;
       if (key == 'Q') {
@@ -238,11 +663,21 @@ int main( int argc, char** argv ) {
 	changed = true;
       }
       if (changed) {
-	saveOffsets(grid.gx, grid.gy);
-	grid.handleGridChange(stitchedImg);
+	if (grid.handleGridChange(canvas)) {
+	  view = canvas.preview(VIEW_WIDTH);
+	  viewOrigin = canvas.bounds().tl();
+	  viewScale = (float)VIEW_WIDTH / canvas.bounds().width;
+	}
+	bundle->saveOffsets(grid.gx, grid.gy);
+	setCellPlaces(grid, places);
+	selectCellFeatures(grid, mapFeatures, allCellFeatures);
+	stitcher.resetMotion();
+	redraw = true;
       }
     }
   }
+  Profiler::dump();
+  source->logCounts(markers);
   key = (char) waitKey(0);
   return 0;
 }
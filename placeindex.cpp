@@ -0,0 +1,68 @@
+#include "placeindex.hpp"
+#include <algorithm>
+
+PlaceIndex::PlaceIndex(const FeatureSet& _features) : features(_features) {
+  if (features.descriptors.depth() == CV_8U) {
+    matcher = makePtr<FlannBasedMatcher>(makePtr<flann::LshIndexParams>(12, 20, 2));
+  } else {
+    matcher = makePtr<FlannBasedMatcher>(makePtr<flann::KDTreeIndexParams>(4),
+					 makePtr<flann::SearchParams>(32));
+  }
+  if (features.descriptors.rows > 0) {
+    double t = getTime();
+    matcher->add(features.descriptors);
+    matcher->train();
+    LOG(INFO) << "Indexed " << features.descriptors.rows << " map features in "
+	      << getTime() - t << "s" << endl;
+  }
+}
+
+void PlaceIndex::setPlaces(const vector<Rect>& places) {
+  // Keypoints are at match scale; places are canvas coordinates.
+  float s = features.scale;
+  placesOf.assign(features.keypoints.size(), vector<int>());
+  placeFeatures.assign(places.size(), 0);
+  for (int i=0; i<features.keypoints.size(); i++) {
+    Point2f p(features.keypoints[i].pt.x / s, features.keypoints[i].pt.y / s);
+    for (int j=0; j<places.size(); j++) {
+      if (places[j].contains(p)) {
+	placesOf[i].push_back(j);
+	placeFeatures[j]++;
+      }
+    }
+  }
+}
+
+void PlaceIndex::query(const Mat& descriptors, int k, vector<int>& ranked) {
+  ScopedTimer timer(Profiler::PLACE_QUERY);
+  ranked.clear();
+  if (descriptors.rows == 0 || features.descriptors.rows == 0) {
+    return;
+  }
+
+  vector<vector<DMatch> > knn;
+  matcher->knnMatch(descriptors, knn, 2);
+  vector<int> votes(placeFeatures.size(), 0);
+  for (int i=0; i<knn.size(); i++) {
+    // Ratio test, as in matching: ambiguous descriptors vote for nothing.
+    if (knn[i].empty() ||
+	(knn[i].size() > 1 && knn[i][0].distance > 0.8f * knn[i][1].distance)) {
+      continue;
+    }
+    const vector<int>& places = placesOf[knn[i][0].trainIdx];
+    for (int j=0; j<places.size(); j++) {
+      votes[places[j]]++;
+    }
+  }
+
+  vector<pair<float, int> > scores;
+  for (int j=0; j<votes.size(); j++) {
+    if (votes[j] >= minVotes) {
+      scores.push_back(make_pair(votes[j] / sqrt((float)placeFeatures[j]), j));
+    }
+  }
+  sort(scores.rbegin(), scores.rend());
+  for (int j=0; j<scores.size() && j<k; j++) {
+    ranked.push_back(scores[j].second);
+  }
+}
@@ -0,0 +1,52 @@
+#include <opencv2/opencv.hpp>
+#include "util.hpp"
+#include "mapbundle.hpp"
+#include "profile.hpp"
+
+#ifndef PLACE_INDEX
+#define PLACE_INDEX
+
+using namespace cv;
+using namespace std;
+
+/**
+ * Finds which places of a map a camera frame shows, from the map's precomputed features.
+ * Places are regions of the canvas, e.g. grid cells. Each frame descriptor that clearly
+ * matches a map feature votes for the places containing it, so ranking every place costs one
+ * approximate nearest-neighbour search per frame feature rather than a full match per place.
+ * Candidates still need geometric verification; the index only orders them.
+ *
+ * Binary descriptors are searched with an LSH index and float ones with randomized k-d
+ * trees. Building the index over a large map takes a moment, so build it once per map.
+ */
+class PlaceIndex {
+  public:
+    /** Index features, which must stay valid while the index is in use. */
+    PlaceIndex(const FeatureSet& features);
+
+    /** Places, in canvas coordinates. Call again when they move. */
+    void setPlaces(const vector<Rect>& places);
+
+    /**
+     * Up to k places ranked by how well frame descriptors match them, best first. Places
+     * with fewer than minVotes votes are left out. Votes are normalized by the square root
+     * of each place's feature count, so places with many features don't win on volume.
+     */
+    void query(const Mat& descriptors, int k, vector<int>& ranked);
+
+    /** Frame descriptors that must agree on a place before it's a candidate. */
+    int minVotes = 8;
+
+  private:
+    const FeatureSet& features;
+
+    Ptr<DescriptorMatcher> matcher;
+
+    /** Places containing each map feature. */
+    vector<vector<int> > placesOf;
+
+    /** Map features in each place. */
+    vector<int> placeFeatures;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#include "profile.hpp"
+#include <chrono>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+using namespace std;
+
+static bool envEnabled() {
+  const char* v = getenv("HANDICAM_PROFILE");
+  return v != NULL && strcmp(v, "0") != 0;
+}
+
+std::atomic<bool> Profiler::enabled(envEnabled());
+std::vector<Profiler::Histogram*> Profiler::registry;
+std::mutex Profiler::registryLock;
+
+std::atomic<bool> Tracer::enabled(false);
+std::vector<Tracer::Event> Tracer::events;
+std::atomic<uint64_t> Tracer::next(0);
+string Tracer::path;
+int64_t Tracer::origin = 0;
+
+static thread_local int64_t currentFrame = 0;
+
+static void writeTrace() {
+  Tracer::write();
+}
+
+// Start tracing before main() if HANDICAM_TRACE names an output file.
+static bool envTrace() {
+  const char* v = getenv("HANDICAM_TRACE");
+  if (v != NULL && *v != '\0') {
+    Tracer::setOutput(v);
+  }
+  return true;
+}
+
+static bool traceInit = envTrace();
+
+Profiler::Histogram::Histogram() {
+  for (int s=0; s<STAGE_COUNT; s++) {
+    for (int b=0; b<BUCKETS; b++) {
+      counts[s][b].store(0, std::memory_order_relaxed);
+    }
+    total[s].store(0, std::memory_order_relaxed);
+    max[s].store(0, std::memory_order_relaxed);
+  }
+}
+
+void Profiler::setEnabled(bool enable) {
+  enabled.store(enable, std::memory_order_relaxed);
+}
+
+int64_t Profiler::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Profiler::Histogram& Profiler::local() {
+  thread_local Histogram* h = NULL;
+  if (h == NULL) {
+    h = new Histogram();
+    std::lock_guard<std::mutex> lock(registryLock);
+    registry.push_back(h);
+  }
+  return *h;
+}
+
+int Profiler::bucket(int64_t ns) {
+  if (ns < SUB_BUCKETS) {
+    return ns < 0 ? 0 : (int)ns;
+  }
+  int e = 63 - __builtin_clzll((uint64_t)ns);
+  int sub = (int)(ns >> (e - 3)) & (SUB_BUCKETS - 1);
+  return (e - 2) * SUB_BUCKETS + sub;
+}
+
+int64_t Profiler::bucketValue(int b) {
+  if (b < SUB_BUCKETS) {
+    return b;
+  }
+  int e = b / SUB_BUCKETS + 2;
+  int sub = b % SUB_BUCKETS;
+  int64_t width = (int64_t)1 << (e - 3);
+  return (SUB_BUCKETS + sub) * width + width / 2;
+}
+
+void Profiler::record(Stage stage, int64_t ns) {
+  // Only this thread writes h, so plain load/store pairs are enough.
+  Histogram& h = local();
+  std::atomic<uint64_t>& c = h.counts[stage][bucket(ns)];
+  c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  h.total[stage].store(h.total[stage].load(std::memory_order_relaxed) + ns,
+		       std::memory_order_relaxed);
+  if (ns > h.max[stage].load(std::memory_order_relaxed)) {
+    h.max[stage].store(ns, std::memory_order_relaxed);
+  }
+}
+
+const char* Profiler::stageName(Stage stage) {
+  static const char* names[STAGE_COUNT] = {
+    "quality", "undistort", "markers", "warp", "mask", "detect", "extract", "match", "estimate",
+    "compose", "display", "grid", "place", "refine"
+  };
+  return names[stage];
+}
+
+Profiler::Summary Profiler::summarize(Stage stage) {
+  std::lock_guard<std::mutex> lock(registryLock);
+  vector<uint64_t> counts(BUCKETS, 0);
+  uint64_t n = 0;
+  int64_t total = 0, max = 0;
+  for (int i=0; i<registry.size(); i++) {
+    Histogram* h = registry[i];
+    for (int b=0; b<BUCKETS; b++) {
+      counts[b] += h->counts[stage][b].load(std::memory_order_relaxed);
+    }
+    total += h->total[stage].load(std::memory_order_relaxed);
+    max = std::max(max, (int64_t)h->max[stage].load(std::memory_order_relaxed));
+  }
+  for (int b=0; b<BUCKETS; b++) {
+    n += counts[b];
+  }
+
+  Summary summary;
+  memset(&summary, 0, sizeof(summary));
+  summary.count = n;
+  if (n == 0) {
+    return summary;
+  }
+  summary.mean = total / 1e6 / n;
+  summary.max = max / 1e6;
+
+  // Walk the buckets once for all percentiles.
+  const double ps[] = {0.50, 0.95, 0.99};
+  double* values[] = {&summary.p50, &summary.p95, &summary.p99};
+  uint64_t seen = 0;
+  int p = 0;
+  for (int b=0; b<BUCKETS && p<3; b++) {
+    seen += counts[b];
+    while (p < 3 && seen >= (uint64_t)ceil(ps[p] * n)) {
+      *values[p++] = std::min(bucketValue(b), max) / 1e6;
+    }
+  }
+  return summary;
+}
+
+void Profiler::dump() {
+  if (!isEnabled()) {
+    return;
+  }
+  LOG(INFO) << "Stage timings (ms):" << endl;
+  for (int s=0; s<STAGE_COUNT; s++) {
+    Summary summary = summarize((Stage)s);
+    if (summary.count == 0) {
+      continue;
+    }
+    char buf[160];
+    snprintf(buf, sizeof(buf), "%-10s n=%-6llu mean=%8.2f p50=%8.2f p95=%8.2f p99=%8.2f max=%8.2f",
+	     stageName((Stage)s), (unsigned long long)summary.count, summary.mean,
+	     summary.p50, summary.p95, summary.p99, summary.max);
+    LOG(INFO) << buf << endl;
+  }
+}
+
+void Tracer::setOutput(const string& _path) {
+  path = _path;
+  if (isEnabled()) {
+    return;
+  }
+  events.resize(CAPACITY);
+  origin = Profiler::now();
+  atexit(writeTrace);
+  enabled.store(true, std::memory_order_release);
+}
+
+int Tracer::threadId() {
+  static std::atomic<int> threads(0);
+  thread_local int id = threads.fetch_add(1, std::memory_order_relaxed);
+  return id;
+}
+
+void Tracer::event(Profiler::Stage stage, int64_t start, int64_t end, int64_t frame) {
+  Event& e = events[next.fetch_add(1, std::memory_order_relaxed) % CAPACITY];
+  e.start = start;
+  e.end = end;
+  e.frame = frame;
+  e.stage = stage;
+  e.thread = threadId();
+}
+
+void Tracer::setFrame(int64_t frame) {
+  currentFrame = frame;
+}
+
+int64_t Tracer::getFrame() {
+  return currentFrame;
+}
+
+bool Tracer::write() {
+  if (!isEnabled()) {
+    return true;
+  }
+  FILE* f = fopen(path.c_str(), "w");
+  if (f == NULL) {
+    LOG(ERROR) << "Failed to write trace: " << path << endl;
+    return false;
+  }
+
+  // Once the ring has wrapped, the oldest event is the one that would be overwritten next.
+  uint64_t n = next.load(std::memory_order_acquire);
+  uint64_t first = n > CAPACITY ? n - CAPACITY : 0;
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (uint64_t i=first; i<n; i++) {
+    const Event& e = events[i % CAPACITY];
+    fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"handicam\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+	    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%lld}}",
+	    i == first ? "" : ",\n", Profiler::stageName((Profiler::Stage)e.stage), e.thread,
+	    (e.start - origin) / 1e3, (e.end - e.start) / 1e3, (long long)e.frame);
+  }
+  fprintf(f, "\n]}\n");
+  bool ok = ferror(f) == 0;
+  fclose(f);
+  LOG(INFO) << "Wrote " << (n - first) << " trace events to " << path << endl;
+  return ok;
+}
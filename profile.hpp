@@ -0,0 +1,220 @@
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <glog/logging.h>
+
+#ifndef PROFILE
+#define PROFILE
+
+using namespace std;
+
+/**
+ * Per-stage latency histograms. Each thread records into its own histograms, so recording
+ * takes no locks; dump() merges them. Buckets are logarithmic with 8 sub-buckets per power
+ * of two, so percentiles are accurate to about 12%.
+ *
+ * Off unless HANDICAM_PROFILE=1 is set in the environment or setEnabled(true) is called.
+ * When off, a ScopedTimer costs one relaxed load.
+ */
+class Profiler {
+  public:
+    enum Stage {
+      QUALITY = 0,
+      UNDISTORT,
+      MARKER_DETECT,
+      WARP,
+      MASK,
+      DETECT,
+      EXTRACT,
+      MATCH,
+      ESTIMATE,
+      COMPOSE,
+      DISPLAY,
+      GRID_METRICS,
+      PLACE_QUERY,
+      REFINE,
+      STAGE_COUNT,
+    };
+
+    static bool isEnabled() {
+      return enabled.load(std::memory_order_relaxed);
+    }
+
+    static void setEnabled(bool enable);
+
+    /** Monotonic time in nanoseconds. */
+    static int64_t now();
+
+    static void record(Stage stage, int64_t ns);
+
+    /** A stage's samples over all threads, in milliseconds. */
+    struct Summary {
+      uint64_t count;
+
+      double mean;
+
+      double p50;
+
+      double p95;
+
+      double p99;
+
+      double max;
+    };
+
+    static Summary summarize(Stage stage);
+
+    /** Log count, mean, p50, p95, p99 and max for each stage, over all threads. */
+    static void dump();
+
+    static const char* stageName(Stage stage);
+
+  private:
+    static const int SUB_BUCKETS = 8;
+
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    /** One thread's counters. Only the owning thread writes; dump() reads concurrently. */
+    struct Histogram {
+      Histogram();
+
+      std::atomic<uint64_t> counts[STAGE_COUNT][BUCKETS];
+
+      std::atomic<int64_t> total[STAGE_COUNT];
+
+      std::atomic<int64_t> max[STAGE_COUNT];
+    };
+
+    /** This thread's histogram, registered on first use. */
+    static Histogram& local();
+
+    static int bucket(int64_t ns);
+
+    /** Midpoint of bucket b, in nanoseconds. */
+    static int64_t bucketValue(int b);
+
+    static std::atomic<bool> enabled;
+
+    /** Histograms of every thread that has recorded. They outlive their threads, so
+	samples from finished workers still show up in dump(). */
+    static std::vector<Histogram*> registry;
+
+    static std::mutex registryLock;
+};
+
+/**
+ * Per-frame trace of the pipeline, for seeing why a single frame stalled. Each stage
+ * interval is recorded with its frame ID and thread into a preallocated ring buffer; when
+ * it wraps, the oldest events are overwritten. On exit the buffer is written as Chrome
+ * trace-event JSON, which about:tracing and Perfetto load.
+ *
+ * Off unless HANDICAM_TRACE=<file.json> is set in the environment or setOutput() is called.
+ */
+class Tracer {
+  public:
+    static bool isEnabled() {
+      return enabled.load(std::memory_order_relaxed);
+    }
+
+    /** Start tracing; the trace is written to path on exit. */
+    static void setOutput(const string& path);
+
+    /** Record stage running from start to end (from Profiler::now()) for frame. */
+    static void event(Profiler::Stage stage, int64_t start, int64_t end, int64_t frame);
+
+    /** Write the buffered events. Called on exit; returns false if the file can't be written. */
+    static bool write();
+
+    /** Frame this thread is working on. Timers started after this are tagged with it. */
+    static void setFrame(int64_t frame);
+
+    static int64_t getFrame();
+
+  private:
+    struct Event {
+      int64_t start;
+
+      int64_t end;
+
+      int64_t frame;
+
+      int stage;
+
+      int thread;
+    };
+
+    /** Small sequential ID for this thread; the first thread to record is 0. */
+    static int threadId();
+
+    static const int CAPACITY = 1 << 16;
+
+    static std::atomic<bool> enabled;
+
+    static std::vector<Event> events;
+
+    /** Total events recorded. Slot next % CAPACITY is written next. */
+    static std::atomic<uint64_t> next;
+
+    static string path;
+
+    static int64_t origin;
+};
+
+/**
+ * Set this thread's frame for the enclosing scope, then restore the previous one. Objects
+ * that can be handed to another thread carry their frame ID and open one of these, so a
+ * frame can be followed across threads.
+ */
+class FrameScope {
+  public:
+    FrameScope(int64_t frame) {
+      previous = Tracer::getFrame();
+      Tracer::setFrame(frame);
+    }
+
+    ~FrameScope() {
+      Tracer::setFrame(previous);
+    }
+
+  private:
+    int64_t previous;
+};
+
+/** Time the enclosing scope as one sample of stage, and trace it if tracing is on. */
+class ScopedTimer {
+  public:
+    ScopedTimer(Profiler::Stage _stage) {
+      stage = _stage;
+      start = Profiler::isEnabled() || Tracer::isEnabled() ? Profiler::now() : 0;
+      frame = start != 0 && Tracer::isEnabled() ? Tracer::getFrame() : 0;
+    }
+
+    ~ScopedTimer() {
+      stop();
+    }
+
+    /** End the sample before the scope ends. */
+    void stop() {
+      if (start != 0) {
+	int64_t end = Profiler::now();
+	if (Profiler::isEnabled()) {
+	  Profiler::record(stage, end - start);
+	}
+	if (Tracer::isEnabled()) {
+	  Tracer::event(stage, start, end, frame);
+	}
+	start = 0;
+      }
+    }
+
+  private:
+    Profiler::Stage stage;
+
+    int64_t start;
+
+    int64_t frame;
+};
+
+#endif
@@ -0,0 +1,456 @@
+#include <algorithm>
+#include <stdio.h>
+
+#include "util.hpp"
+#include "config.hpp"
+#include "markers.hpp"
+#include "stitcher.hpp"
+#include "source.hpp"
+#include "profile.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Headless end-to-end regression check. Replays a session through markers, matching and
+// compositing as stitch_stream does, and compares the result with golden outputs saved
+// from an earlier run:
+//
+//   handicam_regress <dir> [--update]
+//   handicam_regress <dir> --tune <ms per frame>
+//
+// dir holds the session: truth.yml and its frames from handicam_synth, session.avi as
+// recorded by capture, or image files. Golden outputs are golden.yml and golden.png in
+// dir; --update rewrites them from this run. budgets.yml in dir overrides the default
+// budgets. Exits non-zero if anything regressed past its budget.
+//
+// --tune stitches the session with each detector, extractor and match scale instead, and
+// writes the most accurate one that keeps within the time per frame to config.xml. Error
+// is against truth.yml, so tuning needs a session from handicam_synth: golden poses come
+// from the current settings, which would always score best against them.
+
+struct Budgets {
+  // Largest move of any frame's corners on the canvas from golden, in pixels.
+  double poseTolerance = 2.0;
+
+  // Fewest accepted frames allowed, relative to golden.
+  int acceptedDrop = 0;
+
+  // Lowest PSNR of the stitched preview against golden, in dB.
+  double minPsnr = 30.0;
+
+  // Largest fractional drop in fps, and rise in any stage's p95, from golden.
+  double fpsDrop = 0.2;
+
+  double latencyRise = 0.25;
+
+  // Largest error against ground truth, in pixels, and rise in mean error from golden.
+  double maxError = 3.0;
+
+  double errorRise = 0.5;
+
+  void load(const string& file) {
+    FileStorage fs(file, FileStorage::READ);
+    if (!fs.isOpened()) {
+      return;
+    }
+    read(fs, "pose_tolerance_px", poseTolerance);
+    read(fs, "min_psnr_db", minPsnr);
+    read(fs, "fps_drop", fpsDrop);
+    read(fs, "latency_rise", latencyRise);
+    read(fs, "max_error_px", maxError);
+    read(fs, "error_rise_px", errorRise);
+    if (!fs["accepted_drop"].empty()) {
+      acceptedDrop = (int)fs["accepted_drop"];
+    }
+  }
+
+  void read(FileStorage& fs, const string& name, double& value) {
+    if (!fs[name].empty()) {
+      value = (double)fs[name];
+    }
+  }
+};
+
+// What a run produced, or what golden.yml recorded.
+struct Run {
+  // Frame index in the session, whether it was composed, and its pose (canvas to frame).
+  vector<int> frames;
+
+  vector<int> accepted;
+
+  vector<Matx33f> poses;
+
+  Size frameSize;
+
+  double fps = 0.0;
+
+  // p95 of each stage, in ms.
+  double latency[Profiler::STAGE_COUNT] = {};
+
+  // Error against ground truth in canvas pixels, if the session has it; -1 otherwise.
+  double meanError = -1;
+
+  double maxError = -1;
+
+  Mat stitched;
+};
+
+// Session frames as a Source, and each frame's surface-to-frame transform if known.
+Source* openSession(const string& dir, vector<Matx33f>& truth, float& ppi) {
+  FileStorage fs(dir + "/truth.yml", FileStorage::READ);
+  if (fs.isOpened()) {
+    ppi = (float)fs["pixels_per_inch"];
+    FileNode frames = fs["frames"];
+    vector<Image> imgs;
+    for (int i=0; i<frames.size(); i++) {
+      Mat t;
+      frames[i]["surface_to_frame"] >> t;
+      truth.push_back(Matx33f(t));
+      imgs.push_back(asImage(imread(dir + "/" + (string)frames[i]["file"])));
+    }
+    return new ImageSource(imgs);
+  }
+
+  VideoCapture cap;
+  if (cap.open(dir + "/session.avi")) {
+    return new VideoSource(cap);
+  }
+
+  vector<String> files;
+  glob(dir + "/*.jpg", files);
+  vector<String> pngs;
+  glob(dir + "/*.png", pngs);
+  files.insert(files.end(), pngs.begin(), pngs.end());
+  sort(files.begin(), files.end());
+  vector<Image> imgs;
+  for (int i=0; i<files.size(); i++) {
+    if (files[i].find("golden.png") == string::npos) {
+      imgs.push_back(asImage(imread(files[i])));
+    }
+  }
+  return imgs.empty() ? NULL : new ImageSource(imgs);
+}
+
+// Stitch the session the way stitch_stream does, without the UI.
+bool stitch(Config& config, Source* source, Run& run) {
+  Markers markers(config, false);
+  IncrementalStitcher stitcher(config, IncrementalStitcher::MatchMode::PAIRWISE);
+  AffineWarp::Policy policy;
+  if (!AffineWarp::parsePolicy(config.compose_policy, policy)) {
+    LOG(ERROR) << "Unknown compose_policy: " << config.compose_policy << endl;
+    return false;
+  }
+  stitcher.getCanvas().setPolicy(policy, config.seam_band);
+  double t = getTime();
+
+  Image img1;
+  Markers::Status status = Markers::Status::ERR;
+  while (status != Markers::Status::OK && !source->done()) {
+    status = source->nextImage(markers, img1);
+  }
+  if (status != Markers::Status::OK) {
+    LOG(ERROR) << "No frame with markers in session." << endl;
+    return false;
+  }
+  run.frameSize = img1.size();
+  run.frames.push_back(source->getFrameId() - 1);
+  run.accepted.push_back(1);
+  run.poses.push_back(Matx33f::eye());
+
+  while (!source->done()) {
+    Image img2;
+    status = source->nextImage(markers, img2);
+    stitcher.setFrameId(source->getFrameId());
+    stitcher.setFrameTime(source->getFrameTime());
+    // Frames skipped as keyframes still count as accepted, at the pose they matched.
+    IncrementalStitcher::FrameResult result;
+    if (status == Markers::Status::OK) {
+      stitcher.stitchFrame(img1, img2, Size(config.image_width, config.image_height), result);
+    }
+    run.frames.push_back(source->getFrameId() - 1);
+    run.accepted.push_back(result.matched);
+    run.poses.push_back(result.pose);
+  }
+
+  run.fps = run.frames.size() / (getTime() - t);
+  source->logCounts(markers);
+  for (int s=0; s<Profiler::STAGE_COUNT; s++) {
+    run.latency[s] = Profiler::summarize((Profiler::Stage)s).p95;
+  }
+  stitcher.getCanvas().preview(1024).copyTo(run.stitched);
+  return true;
+}
+
+// Largest distance between where poses a and b put the frame's corners on the canvas.
+double poseDistance(Matx33f a, Matx33f b, Size frameSize) {
+  Matx33f ai = a.inv(), bi = b.inv();
+  Point3f corners[4] = {Point3f(0, 0, 1), Point3f(frameSize.width, 0, 1),
+			Point3f(frameSize.width, frameSize.height, 1),
+			Point3f(0, frameSize.height, 1)};
+  double d = 0;
+  for (int i=0; i<4; i++) {
+    Point3f p = ai * corners[i], q = bi * corners[i];
+    d = std::max(d, norm(Point2f(p.x/p.z - q.x/q.z, p.y/p.z - q.y/q.z)));
+  }
+  return d;
+}
+
+// The canvas is the first frame's coordinates, so frame i's true pose is
+// truth[i] * truth[first]^-1.
+void measureAccuracy(Run& run, const vector<Matx33f>& truth) {
+  Matx33f origin = truth[run.frames[0]].inv();
+  double total = 0;
+  int n = 0;
+  run.maxError = 0;
+  for (int i=1; i<run.frames.size(); i++) {
+    if (!run.accepted[i]) {
+      continue;
+    }
+    double e = poseDistance(run.poses[i], truth[run.frames[i]] * origin, run.frameSize);
+    total += e;
+    run.maxError = std::max(run.maxError, e);
+    n++;
+  }
+  run.meanError = n > 0 ? total / n : 0;
+}
+
+void saveGolden(const string& dir, Run& run) {
+  FileStorage fs(dir + "/golden.yml", FileStorage::WRITE);
+  fs << "fps" << run.fps;
+  fs << "mean_error_px" << run.meanError;
+  fs << "max_error_px" << run.maxError;
+  fs << "latency_p95_ms" << "{";
+  for (int s=0; s<Profiler::STAGE_COUNT; s++) {
+    fs << Profiler::stageName((Profiler::Stage)s) << run.latency[s];
+  }
+  fs << "}";
+  fs << "frames" << "[";
+  for (int i=0; i<run.frames.size(); i++) {
+    fs << "{:" << "frame" << run.frames[i] << "accepted" << run.accepted[i]
+       << "pose" << Mat(run.poses[i]) << "}";
+  }
+  fs << "]";
+  fs.release();
+  imwrite(dir + "/golden.png", run.stitched);
+}
+
+bool loadGolden(const string& dir, Run& golden) {
+  FileStorage fs(dir + "/golden.yml", FileStorage::READ);
+  if (!fs.isOpened()) {
+    return false;
+  }
+  golden.fps = (double)fs["fps"];
+  golden.meanError = (double)fs["mean_error_px"];
+  golden.maxError = (double)fs["max_error_px"];
+  FileNode latency = fs["latency_p95_ms"];
+  for (int s=0; s<Profiler::STAGE_COUNT; s++) {
+    FileNode n = latency[Profiler::stageName((Profiler::Stage)s)];
+    golden.latency[s] = n.empty() ? 0 : (double)n;
+  }
+  FileNode frames = fs["frames"];
+  for (int i=0; i<frames.size(); i++) {
+    Mat pose;
+    frames[i]["pose"] >> pose;
+    golden.frames.push_back((int)frames[i]["frame"]);
+    golden.accepted.push_back((int)frames[i]["accepted"]);
+    golden.poses.push_back(Matx33f(pose));
+  }
+  golden.stitched = imread(dir + "/golden.png");
+  return true;
+}
+
+// Print one check and whether it's within budget.
+bool check(const string& name, double value, double golden, bool ok) {
+  printf("%-24s %12.3f %12.3f  %s\n", name.c_str(), value, golden, ok ? "ok" : "REGRESSED");
+  return ok;
+}
+
+bool compare(Run& run, Run& golden, Budgets& budgets) {
+  bool ok = true;
+  printf("%-24s %12s %12s\n", "", "this run", "golden");
+
+  int accepted = 0, goldenAccepted = 0;
+  for (int i=0; i<run.accepted.size(); i++) {
+    accepted += run.accepted[i];
+  }
+  for (int i=0; i<golden.accepted.size(); i++) {
+    goldenAccepted += golden.accepted[i];
+  }
+  ok &= check("accepted frames", accepted, goldenAccepted,
+	      accepted >= goldenAccepted - budgets.acceptedDrop);
+
+  // Frames accepted both times should land in the same place.
+  double drift = 0;
+  if (run.frames == golden.frames) {
+    for (int i=0; i<run.frames.size(); i++) {
+      if (run.accepted[i] && golden.accepted[i]) {
+	drift = std::max(drift, poseDistance(run.poses[i], golden.poses[i], run.frameSize));
+      }
+    }
+    ok &= check("pose drift (px)", drift, 0, drift <= budgets.poseTolerance);
+  } else {
+    ok &= check("frames", run.frames.size(), golden.frames.size(), false);
+  }
+
+  double psnr = 0;
+  if (!golden.stitched.empty() && golden.stitched.size() == run.stitched.size()) {
+    psnr = PSNR(run.stitched, golden.stitched);
+  }
+  ok &= check("psnr vs golden (dB)", psnr, INFINITY, psnr >= budgets.minPsnr);
+
+  ok &= check("fps", run.fps, golden.fps, run.fps >= golden.fps * (1 - budgets.fpsDrop));
+  for (int s=0; s<Profiler::STAGE_COUNT; s++) {
+    if (golden.latency[s] > 0) {
+      ok &= check(string("p95 ") + Profiler::stageName((Profiler::Stage)s) + " (ms)",
+		  run.latency[s], golden.latency[s],
+		  run.latency[s] <= golden.latency[s] * (1 + budgets.latencyRise));
+    }
+  }
+
+  if (run.meanError >= 0 && golden.meanError >= 0) {
+    ok &= check("mean error (px)", run.meanError, golden.meanError,
+		run.meanError <= golden.meanError + budgets.errorRise);
+  }
+  return ok;
+}
+
+int tune(Config& config, const string& dir, double budgetMs) {
+  vector<Matx33f> truth;
+  float ppi = 0;
+  delete openSession(dir, truth, ppi);
+  if (truth.empty()) {
+    LOG(ERROR) << "Tuning needs truth.yml in " << dir << "; record one with handicam_synth."
+	       << endl;
+    return -1;
+  }
+
+  const float SCALES[] = {1.0, 0.75, 0.5};
+  vector<Config> candidates;
+  vector<Run> runs;
+  int mostAccepted = 0;
+  printf("%-6s %-6s %6s %10s %9s %10s\n", "detect", "extract", "scale", "ms/frame",
+	 "accepted", "error (px)");
+  for (int d=0; d<3; d++) {
+    for (int e=0; e<4; e++) {
+      // ORB can't describe SIFT keypoints, whose octave field it misreads.
+      if (d == IncrementalStitcher::DetectMethod::DETECT_SIFT &&
+	  e == IncrementalStitcher::ExtractMethod::EXTRACT_ORB) {
+	continue;
+      }
+      for (int s=0; s<3; s++) {
+	Config candidate = config;
+	candidate.detect_method =
+	  IncrementalStitcher::detectMethodName((IncrementalStitcher::DetectMethod)d);
+	candidate.extract_method =
+	  IncrementalStitcher::extractMethodName((IncrementalStitcher::ExtractMethod)e);
+	candidate.match_scale = SCALES[s];
+
+	vector<Matx33f> frameTruth;
+	Source* source = openSession(dir, frameTruth, ppi);
+	Run run;
+	bool stitched = stitch(candidate, source, run);
+	delete source;
+	if (!stitched) {
+	  continue;
+	}
+	measureAccuracy(run, truth);
+	int accepted = 0;
+	for (int i=0; i<run.accepted.size(); i++) {
+	  accepted += run.accepted[i];
+	}
+	mostAccepted = std::max(mostAccepted, accepted);
+	printf("%-6s %-6s %6.2f %10.1f %9d %10.3f\n", candidate.detect_method.c_str(),
+	       candidate.extract_method.c_str(), candidate.match_scale, 1000 / run.fps,
+	       accepted, run.meanError);
+	candidates.push_back(candidate);
+	runs.push_back(run);
+      }
+    }
+  }
+
+  // Error only counts accepted frames, so a setting that drops the hard ones would look
+  // accurate; only consider those that accept nearly as many as the best.
+  int best = -1;
+  for (int i=0; i<runs.size(); i++) {
+    int accepted = 0;
+    for (int j=0; j<runs[i].accepted.size(); j++) {
+      accepted += runs[i].accepted[j];
+    }
+    if (1000 / runs[i].fps > budgetMs || accepted < 0.9 * mostAccepted) {
+      continue;
+    }
+    if (best < 0 || runs[i].meanError < runs[best].meanError) {
+      best = i;
+    }
+  }
+  if (best < 0) {
+    printf("No setting stitches within %.1f ms per frame.\n", budgetMs);
+    return 1;
+  }
+
+  config.detect_method = candidates[best].detect_method;
+  config.extract_method = candidates[best].extract_method;
+  config.match_scale = candidates[best].match_scale;
+  config.save();
+  printf("Wrote detect_method %s, extract_method %s, match_scale %.2f to %s\n",
+	 config.detect_method.c_str(), config.extract_method.c_str(), config.match_scale,
+	 config.config_file.c_str());
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    LOG(ERROR) << "Usage: " << argv[0] << " <dir> [--update | --tune <ms per frame>]" << endl;
+    return -1;
+  }
+  string dir = argv[1];
+  bool update = argc > 2 && string(argv[2]) == "--update";
+
+  Config config;
+  if (argc > 3 && string(argv[2]) == "--tune") {
+    return tune(config, dir, atof(argv[3]));
+  }
+
+  Budgets budgets;
+  budgets.load(dir + "/budgets.yml");
+  Profiler::setEnabled(true);
+
+  vector<Matx33f> truth;
+  float ppi = 0;
+  Source* source = openSession(dir, truth, ppi);
+  if (source == NULL) {
+    LOG(ERROR) << "No session in " << dir << endl;
+    return -1;
+  }
+  Run run;
+  bool stitched = stitch(config, source, run);
+  delete source;
+  if (!stitched) {
+    return -1;
+  }
+
+  bool ok = true;
+  printf("%d frames, %.2f fps\n", (int)run.frames.size(), run.fps);
+  if (!truth.empty()) {
+    measureAccuracy(run, truth);
+    printf("Error against truth: mean %.3f px (%.4f in), max %.3f px (%.4f in)\n",
+	   run.meanError, run.meanError / ppi, run.maxError, run.maxError / ppi);
+    ok &= check("max error (px)", run.maxError, budgets.maxError,
+		run.maxError <= budgets.maxError);
+  }
+
+  if (update) {
+    saveGolden(dir, run);
+    printf("Updated golden outputs in %s\n", dir.c_str());
+  } else {
+    Run golden;
+    if (loadGolden(dir, golden)) {
+      ok &= compare(run, golden, budgets);
+    } else {
+      printf("No golden outputs; run with --update to save them.\n");
+    }
+  }
+
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
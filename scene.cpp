@@ -0,0 +1,235 @@
+#include "scene.hpp"
+
+using namespace std;
+using namespace cv;
+
+SceneGenerator::SceneGenerator(Config& config, const SceneOptions& _options)
+  : options(_options), rng(_options.seed) {
+  imageSize = Size(config.image_width, config.image_height);
+  boardWidth = config.markerboard_width;
+  boardHeight = config.markerboard_height;
+  boardOffset = config.markerboard_offset;
+  markerSize = boardOffset > 0 ? boardOffset * 0.8f : 0.5f;
+
+  // Markers projects the board to image_width across, so that's the surface resolution too.
+  ppi = (float)config.image_width / boardWidth;
+  margin = cvRound(margin * ppi) / ppi;
+  surface = texture(Size(cvRound(options.surfaceWidth * ppi),
+			 cvRound(options.surfaceHeight * ppi)), options.seed);
+
+  // Markers::crop() truncates its border to whole pixels.
+  int projRows = (int)(config.image_width * (boardHeight / boardWidth));
+  cropX = (int)(ppi * boardOffset);
+  cropY = (int)(projRows / boardHeight * boardOffset);
+
+  if (config.cameraMatrix.empty()) {
+    cameraMatrix = Mat(Matx33d(imageSize.width, 0, imageSize.width / 2.0,
+			       0, imageSize.width, imageSize.height / 2.0,
+			       0, 0, 1));
+    distCoeffs = Mat::zeros(1, 5, CV_64F);
+  } else {
+    config.cameraMatrix.convertTo(cameraMatrix, CV_64F);
+    config.distCoeffs.convertTo(distCoeffs, CV_64F);
+  }
+
+  // Mount the camera over the middle of the board, high enough that the board and its
+  // marker pads fill 85% of the frame, tilted a little.
+  double fx = cameraMatrix.at<double>(0, 0);
+  double fy = cameraMatrix.at<double>(1, 1);
+  float pad = markerSize / 4;
+  double height = std::max((boardWidth + pad*2) * fx / (0.85 * imageSize.width),
+			   (boardHeight + pad*2) * fy / (0.85 * imageSize.height));
+  cameraPpi = fx / height;
+  mountPosition = Vec3d(boardWidth / 2, boardHeight / 2, -height);
+  double tilt = options.tilt * CV_PI / 180;
+  mountRotation = Vec3d(rng.uniform(-tilt, tilt), rng.uniform(-tilt, tilt), 0);
+
+  // Lens distortion is rendered by sampling each image pixel at its undistorted position.
+  vector<Point2f> pixels;
+  for (int y=0; y<imageSize.height; y++) {
+    for (int x=0; x<imageSize.width; x++) {
+      pixels.push_back(Point2f(x, y));
+    }
+  }
+  Mat points;
+  undistortPoints(pixels, points, cameraMatrix, distCoeffs, noArray(), cameraMatrix);
+  undistorted = points.reshape(2, imageSize.height);
+
+  // Each marker is turned a quarter clockwise per corner, so its first corner is at board
+  // corner i, on a white pad.
+  Ptr<aruco::Dictionary> dictionary = aruco::getPredefinedDictionary(aruco::DICT_4X4_50);
+  markerSide = cvRound(markerSize * ppi);
+  markerPad = cvRound(pad * ppi);
+  for (int i=0; i<4; i++) {
+    Mat marker, turned;
+    aruco::drawMarker(dictionary, i, markerSide, marker);
+    for (int r=0; r<i; r++) {
+      transpose(marker, turned);
+      flip(turned, marker, 1);
+    }
+    int side = markerSide + markerPad*2;
+    Mat padded(side, side, CV_8UC3, Scalar::all(255));
+    cvtColor(marker, padded(Rect(markerPad, markerPad, markerSide, markerSide)), CV_GRAY2BGR);
+    markerImgs.push_back(padded);
+  }
+
+  makePath();
+}
+
+Mat SceneGenerator::getSurface() {
+  return surface;
+}
+
+float SceneGenerator::getPixelsPerInch() {
+  return ppi;
+}
+
+Mat SceneGenerator::texture(Size size, uint64 seed) {
+  RNG rng(seed);
+  Mat coarse(size.height/16 + 1, size.width/16 + 1, CV_8UC3), img;
+  rng.fill(coarse, RNG::UNIFORM, Scalar::all(60), Scalar::all(200));
+  resize(coarse, img, size, 0, 0, INTER_CUBIC);
+  for (int i=0; i<size.area() / 4000; i++) {
+    Point c(rng.uniform(0, size.width), rng.uniform(0, size.height));
+    Scalar color(rng.uniform(0, 255), rng.uniform(0, 255), rng.uniform(0, 255));
+    if (i % 2) {
+      circle(img, c, rng.uniform(3, 30), color, -1, CV_AA);
+    } else {
+      line(img, c, c + Point(rng.uniform(-60, 60), rng.uniform(-60, 60)), color,
+	   rng.uniform(1, 4), CV_AA);
+    }
+  }
+  return img;
+}
+
+void SceneGenerator::makePath() {
+  // Keep the rendered plane on the surface, allowing for rotation.
+  float lo = margin + 1;
+  float hiX = std::max(lo, options.surfaceWidth - boardWidth - margin - 1);
+  float hiY = std::max(lo, options.surfaceHeight - boardHeight - margin - 1);
+
+  // Serpentine rows half a board apart, joined at the ends.
+  vector<Point2f> corners;
+  bool forward = true;
+  for (float y=lo; ; y+=boardHeight/2) {
+    y = std::min(y, hiY);
+    corners.push_back(Point2f(forward ? lo : hiX, y));
+    corners.push_back(Point2f(forward ? hiX : lo, y));
+    forward = !forward;
+    if (y >= hiY) {
+      break;
+    }
+  }
+
+  path.push_back(corners[0]);
+  for (int i=1; i<corners.size(); i++) {
+    Point2f d = corners[i] - corners[i-1];
+    int n = std::max(1, (int)ceil(norm(d) / options.step));
+    for (int k=1; k<=n; k++) {
+      path.push_back(corners[i-1] + d * ((float)k / n));
+    }
+  }
+}
+
+Mat SceneGenerator::renderPlane(float x, float y, float angle) {
+  // Plane pixel q is board point q/ppi - margin. Sample the surface under it.
+  double a = angle * CV_PI / 180;
+  double c = cos(a), s = sin(a);
+  double m = margin * ppi;
+  Mat A = Mat(Matx23d(c, -s, x*ppi - (c*m - s*m),
+		      s, c, y*ppi - (s*m + c*m)));
+  Size size(cvRound((boardWidth + margin*2) * ppi), cvRound((boardHeight + margin*2) * ppi));
+  Mat plane;
+  warpAffine(surface, plane, A, size, INTER_LINEAR | WARP_INVERSE_MAP, BORDER_REFLECT);
+
+  // Place each marker so the outer edge of its first corner is exactly on the board corner.
+  Point2f boardCorners[4] = {Point2f(0, 0), Point2f(boardWidth, 0),
+			     Point2f(boardWidth, boardHeight), Point2f(0, boardHeight)};
+  Point2f markerCorners[4] = {Point2f(0, 0), Point2f(markerSide, 0),
+			      Point2f(markerSide, markerSide), Point2f(0, markerSide)};
+  for (int i=0; i<4; i++) {
+    Point2f q = (boardCorners[i] + Point2f(margin, margin)) * ppi;
+    Point2f t = q - markerCorners[i] - Point2f(markerPad, markerPad) + Point2f(0.5, 0.5);
+    warpAffine(markerImgs[i], plane, Mat(Matx23d(1, 0, t.x, 0, 1, t.y)), plane.size(),
+	       INTER_LINEAR, BORDER_TRANSPARENT);
+  }
+
+  // The plane is finer than the camera sees it; filter before sampling.
+  double sigma = 0.5 * ppi / cameraPpi;
+  if (sigma > 0.5) {
+    GaussianBlur(plane, plane, Size(0, 0), sigma);
+  }
+  return plane;
+}
+
+SceneFrame SceneGenerator::render(float x, float y, float angle) {
+  SceneFrame f;
+  f.x = x;
+  f.y = y;
+  f.angle = angle;
+  Mat plane = renderPlane(x, y, angle);
+
+  // The camera for this frame: the mount, plus a little wobble.
+  double jitter = options.jitter * CV_PI / 180;
+  Vec3d rvec = mountRotation;
+  for (int i=0; i<3; i++) {
+    rvec[i] += rng.gaussian(jitter);
+  }
+  Mat R;
+  Rodrigues(rvec, R);
+  Mat tvec = -R * Mat(mountPosition);
+
+  // Homography from the board plane, in inches, to the undistorted image, then from image
+  // pixels back to plane pixels.
+  Mat P, Hb;
+  hconcat(R.col(0), R.col(1), P);
+  hconcat(P, tvec, P);
+  Hb = cameraMatrix * P;
+  double m = margin * ppi;
+  Mat G = Mat(Matx33d(ppi, 0, m,
+		      0, ppi, m,
+		      0, 0, 1));
+  Mat toPlane = G * Hb.inv();
+  Mat map;
+  perspectiveTransform(undistorted, map, toPlane);
+  remap(plane, f.img, map, Mat(), INTER_LINEAR, BORDER_REPLICATE);
+
+  if (options.blur > 0) {
+    GaussianBlur(f.img, f.img, Size(0, 0), options.blur);
+  }
+  if (options.noise > 0) {
+    Mat noise(f.img.size(), CV_16SC3), img;
+    rng.fill(noise, RNG::NORMAL, Scalar::all(0), Scalar::all(options.noise));
+    f.img.convertTo(img, CV_16SC3);
+    add(img, noise, img);
+    img.convertTo(f.img, CV_8UC3);
+  }
+
+  vector<Point3f> board;
+  board.push_back(Point3f(0, 0, 0));
+  board.push_back(Point3f(boardWidth, 0, 0));
+  board.push_back(Point3f(boardWidth, boardHeight, 0));
+  board.push_back(Point3f(0, boardHeight, 0));
+  vector<Point2f> corners;
+  projectPoints(board, rvec, tvec, cameraMatrix, distCoeffs, corners);
+  for (int i=0; i<4; i++) {
+    f.corners[i] = corners[i];
+  }
+
+  // Surface pixel p is at board point Rot^T (p/ppi - (x, y)), which Markers projects to
+  // ppi per inch and crops.
+  double a = angle * CV_PI / 180;
+  double c = cos(a), s = sin(a);
+  f.surfaceToFrame = Matx33f(c, s, -(c*x + s*y) * ppi - cropX,
+			     -s, c, -(-s*x + c*y) * ppi - cropY,
+			     0, 0, 1);
+  return f;
+}
+
+SceneFrame SceneGenerator::next() {
+  Point2f p = path[frame % path.size()];
+  frame++;
+  pathAngle += rng.gaussian(0.5);
+  pathAngle = std::max(-options.maxRotation, std::min(options.maxRotation, pathAngle));
+  return render(p.x, p.y, pathAngle);
+}
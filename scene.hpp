@@ -0,0 +1,151 @@
+#include <opencv2/opencv.hpp>
+#include <opencv2/aruco.hpp>
+#include "util.hpp"
+#include "config.hpp"
+
+#ifndef SCENE
+#define SCENE
+
+using namespace cv;
+using namespace std;
+
+struct SceneOptions {
+  /** Work surface size, in inches. */
+  float surfaceWidth = 24.0;
+
+  float surfaceHeight = 18.0;
+
+  /** Distance the board moves between frames, in inches. */
+  float step = 0.75;
+
+  /** Largest board rotation on the surface, in degrees. */
+  float maxRotation = 5.0;
+
+  /** Largest tilt of the camera mount from straight down, in degrees. */
+  float tilt = 3.0;
+
+  /** Frame-to-frame wobble of the camera on its mount, in degrees. */
+  float jitter = 0.1;
+
+  /** Defocus blur sigma, in pixels. */
+  float blur = 0.8;
+
+  /** Sensor noise sigma, in gray levels. */
+  float noise = 2.0;
+
+  uint64 seed = 1;
+};
+
+/** A rendered camera frame and where everything in it really is. */
+struct SceneFrame {
+  Mat img;
+
+  /** Image position of each board corner (the first corner of marker i), as
+      Markers::getArucoOrientedImage should find them. */
+  Point2f corners[4];
+
+  /** Board pose on the surface: position of corner 0 in inches, rotation in degrees. */
+  float x;
+
+  float y;
+
+  float angle;
+
+  /** Transform from surface pixels (see getSurface()) to the frame as projected and cropped
+      by Markers. For frames a and b, IncrementalStitcher should estimate
+      b.surfaceToFrame * a.surfaceToFrame.inv(). */
+  Matx33f surfaceToFrame;
+};
+
+/**
+ * Renders the four-marker board (DICT_4X4_50, IDs 0-3, geometry from config) lying on a
+ * textured work surface, as seen by the camera mounted over it: perspective from a slightly
+ * tilted mount, lens distortion from the calibration in config, blur and noise. The board
+ * follows a serpentine scan over the surface, so a sequence of frames can be stitched.
+ *
+ * Without a calibration in config, the camera has no distortion and a focal length of
+ * image_width pixels.
+ */
+class SceneGenerator {
+  public:
+    SceneGenerator(Config& config, const SceneOptions& options=SceneOptions());
+
+    /** The work surface, at the resolution Markers projects frames to. */
+    Mat getSurface();
+
+    /** Surface and projected frame resolution. */
+    float getPixelsPerInch();
+
+    /** Render the board at (x, y) inches on the surface, rotated angle degrees. */
+    SceneFrame render(float x, float y, float angle);
+
+    /** Render the next frame of the scan. */
+    SceneFrame next();
+
+    /** A textured work surface with detail at several scales. */
+    static Mat texture(Size size, uint64 seed);
+
+  private:
+    /** Board plane image for a pose: the surface under it with the markers on top. */
+    Mat renderPlane(float x, float y, float angle);
+
+    /** Board positions of the scan, step apart. */
+    void makePath();
+
+    SceneOptions options;
+
+    Size imageSize;
+
+    float boardWidth;
+
+    float boardHeight;
+
+    float boardOffset;
+
+    /** Marker side, in inches. */
+    float markerSize;
+
+    /** Marker side and the white pad around it, in surface pixels. */
+    int markerSide;
+
+    int markerPad;
+
+    /** Pixels Markers::crop() removes from the left and top of the projected board. */
+    int cropX;
+
+    int cropY;
+
+    /** Board plane rendered around the board, in inches. Covers the camera's view. */
+    float margin = 2.0;
+
+    float ppi;
+
+    /** Camera resolution on the board, in pixels per inch. */
+    double cameraPpi;
+
+    Mat surface;
+
+    Mat cameraMatrix;
+
+    Mat distCoeffs;
+
+    /** Camera mount rotation and position, relative to the board. */
+    Vec3d mountRotation;
+
+    Vec3d mountPosition;
+
+    /** Undistorted position of each image pixel, CV_32FC2. */
+    Mat undistorted;
+
+    vector<Mat> markerImgs;
+
+    vector<Point2f> path;
+
+    int frame = 0;
+
+    float pathAngle = 0.0;
+
+    RNG rng;
+};
+
+#endif
@@ -4,17 +4,63 @@ bool Source::done() {
   return false;
 };
 
+int64_t Source::getFrameId() {
+  return frameId;
+}
+
+double Source::getFrameTime() {
+  return frameTime;
+}
+
+int64_t Source::getCount(Markers::Status status) {
+  map<Markers::Status, int64_t>::iterator it = counts.find(status);
+  return it == counts.end() ? 0 : it->second;
+}
+
+void Source::logCounts(Markers& markers) {
+  for (map<Markers::Status, int64_t>::iterator it=counts.begin(); it!=counts.end(); it++) {
+    if (it->first == Markers::Status::OK) {
+      LOG(INFO) << it->second << " of " << frameId << " frames OK" << endl;
+    } else {
+      LOG(INFO) << it->second << " of " << frameId << " frames: "
+		<< markers.getError(it->first) << endl;
+    }
+  }
+}
+
+void Source::beginFrame() {
+  Tracer::setFrame(++frameId);
+}
+
+Markers::Status Source::process(Markers& markers, Image& img, Image& imgProj) {
+  // Drop blurred and badly exposed frames before spending anything on them.
+  Markers::Status status = markers.checkQuality(img, board, sharpness);
+  if (status == Markers::Status::OK) {
+    status = markers.getArucoOrientedImage(img, imgProj);
+    markers.getBoard(board);
+  }
+  if (status == Markers::Status::OK && imgProj.cols == 0) {
+    status = Markers::Status::ERR;
+  }
+  counts[status]++;
+  return status;
+}
+
 
 VideoSource::VideoSource(VideoCapture vc) {
   cap = vc;
 }
 
-Markers::Status VideoSource::nextImage(Markers markers, UMat& imgProj) {
-  UMat img;
+Markers::Status VideoSource::nextImage(Markers markers, Image& imgProj) {
+  beginFrame();
+  Image img;
   // Blow away any buffered frames so we don't lag.
   for (int i=0; i<SKIP_FRAMES; i++) {
     cap >> img;
   }
+  // Video files report each frame's position; fall back to the clock where there's none.
+  double ms = cap.get(CV_CAP_PROP_POS_MSEC);
+  frameTime = ms > 0 ? ms / 1000 : getTime();
   //TODO: make debug mode
   /*
     char buf [3];
@@ -25,10 +71,7 @@ Markers::Status VideoSource::nextImage(Markers markers, UMat& imgProj) {
   */
   Markers::Status status;
   if (img.cols > 0) {
-    status = markers.getArucoOrientedImage(img, imgProj);
-    if (status == Markers::Status::OK && imgProj.cols == 0) {
-      status = Markers::Status::ERR;
-    }
+    status = process(markers, img, imgProj);
   } else {
     isDone = true;
     status = Markers::Status::ERR;
@@ -41,18 +84,16 @@ bool VideoSource::done() {
 }
 
 
-ImageSource::ImageSource(vector<UMat> i) {
+ImageSource::ImageSource(vector<Image> i) {
   imgs = i;
 }
 
-Markers::Status ImageSource::nextImage(Markers markers, UMat& imgProj) {
-  UMat img = imgs.front();
+Markers::Status ImageSource::nextImage(Markers markers, Image& imgProj) {
+  beginFrame();
+  frameTime = frameId * FRAME_INTERVAL;
+  Image img = imgs.front();
   imgs.erase(imgs.begin());
-  Markers::Status status = markers.getArucoOrientedImage(img, imgProj);
-  if (status == Markers::Status::OK && imgProj.cols == 0) {
-    status = Markers::Status::ERR;
-  }
-  return status;
+  return process(markers, img, imgProj);
 }
 
 bool ImageSource::done() {
@@ -1,5 +1,8 @@
 #include <opencv2/opencv.hpp>
+#include <map>
 #include "markers.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
 
 #ifndef SOURCE
 #define SOURCE
@@ -9,15 +12,47 @@ using namespace std;
 
 class Source {
   public:
-  virtual Markers::Status nextImage(Markers markers, UMat& imgProj) = 0;
+  virtual Markers::Status nextImage(Markers markers, Image& imgProj) = 0;
   virtual bool done();
   virtual ~Source(){}
+
+  // ID of the frame returned by the last nextImage(), starting at 1.
+  int64_t getFrameId();
+
+  // When the frame returned by the last nextImage() was captured, in seconds. Replayed
+  // frames keep their recorded spacing however fast they're processed.
+  double getFrameTime();
+
+  // Number of frames nextImage() has returned with status.
+  int64_t getCount(Markers::Status status);
+
+  // Log how many frames were returned with each status, e.g. dropped as blurred.
+  void logCounts(Markers& markers);
+
+  protected:
+  // Number the next frame and make it this thread's current trace frame.
+  void beginFrame();
+
+  // Gate, project and count a camera frame.
+  Markers::Status process(Markers& markers, Image& img, Image& imgProj);
+
+  int64_t frameId = 0;
+
+  double frameTime = 0;
+
+  map<Markers::Status, int64_t> counts;
+
+  // Markerboard in the last frame, and the sharpness of recent frames, for checkQuality.
+  // Kept here since callers pass Markers by value.
+  vector<Point2f> board;
+
+  WindowStats sharpness;
 };
 
 class VideoSource: public Source {
   public:
   VideoSource(VideoCapture vc);
-  virtual Markers::Status nextImage(Markers markers, UMat& imgProj);
+  virtual Markers::Status nextImage(Markers markers, Image& imgProj);
   virtual bool done();
 
   private:
@@ -29,12 +64,14 @@ class VideoSource: public Source {
 
 class ImageSource: public Source {
   public:
-  ImageSource(vector<UMat> i);
-  virtual Markers::Status nextImage(Markers markers, UMat& imgProj);
+  ImageSource(vector<Image> i);
+  virtual Markers::Status nextImage(Markers markers, Image& imgProj);
   virtual bool done();
 
   private:
-  vector<UMat> imgs;
+  vector<Image> imgs;
+  // Images have no timestamps; space them as a camera at this rate would.
+  const double FRAME_INTERVAL = 1.0 / 30;
 };
 
 #endif
@@ -0,0 +1,233 @@
+#include "stats.hpp"
+#include <algorithm>
+
+WindowStats::WindowStats(int window) : samples(window) {
+}
+
+void WindowStats::add(double x) {
+  // Take the oldest sample out of the running mean and variance before it's overwritten.
+  if (samples.full()) {
+    double old = samples.oldest();
+    int n = samples.size() - 1;
+    if (n == 0) {
+      m = 0;
+      s = 0;
+    } else {
+      double d = old - m;
+      m -= d / n;
+      s -= d * (old - m);
+    }
+  }
+  samples.push(x);
+  double d = x - m;
+  m += d / samples.size();
+  s += d * (x - m);
+  s = std::max(s, 0.0); // Rounding can leave it slightly negative.
+}
+
+void WindowStats::clear() {
+  samples.clear();
+  m = 0;
+  s = 0;
+}
+
+int WindowStats::count() const {
+  return samples.size();
+}
+
+double WindowStats::mean() const {
+  return m;
+}
+
+double WindowStats::variance() const {
+  return samples.size() > 1 ? s / (samples.size() - 1) : 0;
+}
+
+double WindowStats::stddev() const {
+  return sqrt(variance());
+}
+
+// Two-sided 95% quantile of Student's t distribution with df degrees of freedom. Windows are
+// small, so the normal 1.96 would overstate the precision of the mean; past 30 it's close.
+static double tQuantile(int df) {
+  static const double T95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+  };
+  const int N = sizeof(T95) / sizeof(T95[0]);
+  if (df < 1) {
+    return INFINITY;
+  }
+  return df <= N ? T95[df - 1] : 1.96;
+}
+
+// Half-width of the 95% confidence interval of the mean of n samples with standard
+// deviation sd.
+static double interval(double sd, int n) {
+  return n > 1 ? tQuantile(n - 1) * sd / sqrt((double)n) : INFINITY;
+}
+
+double WindowStats::confidence() const {
+  return interval(stddev(), samples.size());
+}
+
+// Median of values, which is reordered.
+static double medianOf(vector<double>& values) {
+  if (values.empty()) {
+    return 0;
+  }
+  int mid = values.size() / 2;
+  std::nth_element(values.begin(), values.begin() + mid, values.end());
+  double median = values[mid];
+  if (values.size() % 2 == 0) {
+    median = (median + *std::max_element(values.begin(), values.begin() + mid)) / 2;
+  }
+  return median;
+}
+
+double WindowStats::median() const {
+  vector<double> values;
+  for (int i=0; i<samples.size(); i++) {
+    values.push_back(samples[i]);
+  }
+  return medianOf(values);
+}
+
+double WindowStats::mad() const {
+  double median = this->median();
+  vector<double> deviations;
+  for (int i=0; i<samples.size(); i++) {
+    deviations.push_back(fabs(samples[i] - median));
+  }
+  return 1.4826 * medianOf(deviations);
+}
+
+// Number of samples within limit of median.
+static int countWithin(const RingBuffer<double>& samples, double median, double limit) {
+  int n = 0;
+  for (int i=0; i<samples.size(); i++) {
+    if (fabs(samples[i] - median) <= limit) {
+      n++;
+    }
+  }
+  return n;
+}
+
+double WindowStats::spread() const {
+  double mad = this->mad();
+  return mad > 0 ? mad : stddev();
+}
+
+double WindowStats::robustMean(double k) const {
+  double median = this->median();
+  double limit = k * spread();
+  double total = 0;
+  int n = 0;
+  for (int i=0; i<samples.size(); i++) {
+    if (fabs(samples[i] - median) <= limit) {
+      total += samples[i];
+      n++;
+    }
+  }
+  return n > 0 ? total / n : median;
+}
+
+double WindowStats::robustConfidence(double k) const {
+  double spread = this->spread();
+  return interval(spread, countWithin(samples, median(), k * spread));
+}
+
+double WindowStats::min() const {
+  double v = INFINITY;
+  for (int i=0; i<samples.size(); i++) {
+    v = std::min(v, samples[i]);
+  }
+  return v;
+}
+
+double WindowStats::max() const {
+  double v = -INFINITY;
+  for (int i=0; i<samples.size(); i++) {
+    v = std::max(v, samples[i]);
+  }
+  return v;
+}
+
+double WindowStats::range() const {
+  return samples.size() > 0 ? max() - min() : 0;
+}
+
+AngleStats::AngleStats(int window) : samples(window), cosines(window), sines(window) {
+}
+
+void AngleStats::add(double degrees) {
+  double r = degrees * CV_PI / 180;
+  samples.push(degrees);
+  cosines.add(cos(r));
+  sines.add(sin(r));
+}
+
+void AngleStats::clear() {
+  samples.clear();
+  cosines.clear();
+  sines.clear();
+}
+
+int AngleStats::count() const {
+  return samples.size();
+}
+
+double AngleStats::mean() const {
+  return atan2(sines.mean(), cosines.mean()) * 180 / CV_PI;
+}
+
+double AngleStats::stddev() const {
+  // From the length of the mean unit vector, which is 1 when all samples agree.
+  double r = std::min(sqrt(cosines.mean()*cosines.mean() + sines.mean()*sines.mean()), 1.0);
+  return r > 0 ? sqrt(-2 * log(r)) * 180 / CV_PI : 180;
+}
+
+double AngleStats::confidence() const {
+  return interval(stddev(), samples.size());
+}
+
+double AngleStats::range() const {
+  double mean = this->mean();
+  double lo = 0, hi = 0;
+  for (int i=0; i<samples.size(); i++) {
+    double d = remainder(samples[i] - mean, 360.0);
+    lo = std::min(lo, d);
+    hi = std::max(hi, d);
+  }
+  return hi - lo;
+}
+
+PoseStats::PoseStats(int window) : x(window), y(window), angle(window), scale(window) {
+}
+
+void PoseStats::add(const Matx33f& H) {
+  x.add(H(0,2));
+  y.add(H(1,2));
+  angle.add(atan2(H(1,0), H(0,0)) * 180 / CV_PI);
+  scale.add(sqrt(H(0,0)*H(0,0) + H(1,0)*H(1,0)));
+}
+
+void PoseStats::clear() {
+  x.clear();
+  y.clear();
+  angle.clear();
+  scale.clear();
+}
+
+int PoseStats::count() const {
+  return x.count();
+}
+
+Matx33f PoseStats::mean() const {
+  double r = angle.mean() * CV_PI / 180;
+  double s = scale.mean();
+  return Matx33f(s*cos(r), -s*sin(r), x.robustMean(),
+		 s*sin(r),  s*cos(r), y.robustMean(),
+		 0, 0, 1);
+}
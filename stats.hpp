@@ -0,0 +1,183 @@
+#include <opencv2/opencv.hpp>
+#include <vector>
+#include <algorithm>
+
+#ifndef STATS
+#define STATS
+
+using namespace cv;
+using namespace std;
+
+/** The last capacity values pushed, oldest first. Pushing onto a full buffer drops the
+    oldest value, without moving the others. Capacity is at least 1. */
+template<typename T> class RingBuffer {
+  public:
+    RingBuffer(int capacity=10) : items(std::max(capacity, 1)) {}
+
+    void push(const T& value) {
+      items[(start + n) % items.size()] = value;
+      if (n < items.size()) {
+	n++;
+      } else {
+	start = (start + 1) % items.size();
+      }
+    }
+
+    /** Value i, where 0 is the oldest. */
+    const T& operator[](int i) const {
+      return items[(start + i) % items.size()];
+    }
+
+    const T& oldest() const {
+      return items[start];
+    }
+
+    int size() const {
+      return n;
+    }
+
+    int capacity() const {
+      return items.size();
+    }
+
+    bool full() const {
+      return n == items.size();
+    }
+
+    void clear() {
+      start = 0;
+      n = 0;
+    }
+
+  private:
+    vector<T> items;
+
+    int start = 0;
+
+    int n = 0;
+};
+
+/**
+ * Statistics of the last window samples of a measurement. The mean and variance are kept
+ * up to date as samples come and go (Welford's method), so they cost O(1) per sample; the
+ * median, MAD, min and max are computed over the window when asked for.
+ */
+class WindowStats {
+  public:
+    WindowStats(int window=10);
+
+    void add(double x);
+
+    void clear();
+
+    int count() const;
+
+    double mean() const;
+
+    /** Sample variance; 0 with fewer than 2 samples. */
+    double variance() const;
+
+    double stddev() const;
+
+    /** Half-width of the 95% confidence interval of the mean, from Student's t with
+	count() - 1 degrees of freedom. It narrows as consistent samples arrive, so it's
+	meaningful well before the window fills. Infinite with fewer than 2 samples. */
+    double confidence() const;
+
+    double median() const;
+
+    /** Median absolute deviation from the median, scaled to estimate the standard
+	deviation of normally distributed samples. Unmoved by a few outliers. */
+    double mad() const;
+
+    /** Mean of the samples within k spreads of the median, where the spread is the MAD, or
+	the standard deviation if the MAD is 0. */
+    double robustMean(double k=3.0) const;
+
+    /** Half-width of the 95% confidence interval of robustMean(k), taking the same spread
+	as that of the samples it keeps, so outliers widen it no more than they move the
+	mean. Infinite with fewer than 2 samples kept. */
+    double robustConfidence(double k=3.0) const;
+
+    double min() const;
+
+    double max() const;
+
+    double range() const;
+
+  private:
+    /** The MAD, or the standard deviation when over half the samples are equal and the MAD
+	is 0, so a few repeated values can't make the spread vanish. */
+    double spread() const;
+
+    RingBuffer<double> samples;
+
+    double m = 0;
+
+    /** Sum of squared differences from the mean. */
+    double s = 0;
+};
+
+/**
+ * Statistics of angles in degrees over a window. Angles are averaged as unit vectors, so
+ * samples either side of +/-180 average to 180 rather than 0.
+ */
+class AngleStats {
+  public:
+    AngleStats(int window=10);
+
+    void add(double degrees);
+
+    void clear();
+
+    int count() const;
+
+    /** Circular mean, in (-180, 180]. */
+    double mean() const;
+
+    /** Circular standard deviation, in degrees. */
+    double stddev() const;
+
+    /** Half-width of the 95% confidence interval of the mean, as WindowStats. */
+    double confidence() const;
+
+    /** Largest spread of the samples around the mean, in degrees. */
+    double range() const;
+
+  private:
+    RingBuffer<double> samples;
+
+    WindowStats cosines;
+
+    WindowStats sines;
+};
+
+/**
+ * Statistics of similarity transforms over a window: translation, rotation and scale are
+ * tracked separately, and the mean transform is rebuilt from their means, so rotation is
+ * averaged as an angle rather than entry by entry.
+ */
+class PoseStats {
+  public:
+    PoseStats(int window=10);
+
+    void add(const Matx33f& H);
+
+    void clear();
+
+    int count() const;
+
+    /** Transform from the robust mean translation and the mean rotation and scale. */
+    Matx33f mean() const;
+
+    WindowStats x;
+
+    WindowStats y;
+
+    /** Rotation of each transform, in degrees counterclockwise. */
+    AngleStats angle;
+
+    WindowStats scale;
+};
+
+#endif
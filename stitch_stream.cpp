@@ -5,45 +5,79 @@
 #include "config.hpp"
 #include "stitcher.hpp"
 #include "source.hpp"
+#include "mapbundle.hpp"
+#include "tileexport.hpp"
+#include "journal.hpp"
+#include "profile.hpp"
 
 using namespace std;
 using namespace cv;
 
-vector<double> dmtime;
-
-void showError(string error, UMat img) {
+void showError(string error, Image img) {
   LOG(ERROR) << error << endl;
   drawText(img, error, 2);
 }
 
-void stats() {
-  int count = dmtime.size();
-  double max=-1;
-  double min=100000;
-  double sum=0;
-  double mean=0;
-  for (int i=0; i<count; i++) {
-    sum += dmtime[i];
-    if (dmtime[i] > max) max = dmtime[i];
-    if (dmtime[i] < min) min = dmtime[i];
-  }
-  mean = sum / (double)count;
-  LOG(INFO) << "MAX: " << max << endl;
-  LOG(INFO) << "MIN: " << min << endl;
-  LOG(INFO) << "MEAN: " << mean << endl;
+// Export the stitched canvas, keeping the UI up until a key is pressed.
+void finish(Canvas& canvas) {
+  canvas.flush();
+
+  // Export in the background; the UI stays live while tiles are written.
+  TileExporter exporter("stitched.tiles");
+  exporter.start(canvas);
+  waitKey(0);
+  if (!exporter.done()) {
+    LOG(INFO) << "Waiting for export..." << endl;
+  }
+  TileExporter::Status estatus = exporter.wait();
+  if (estatus != TileExporter::Status::OK) {
+    LOG(ERROR) << exporter.getError(estatus) << endl;
+  }
+}
+
+// Compose into canvas by the configured policy.
+bool setPolicy(Config& config, Canvas& canvas) {
+  AffineWarp::Policy policy;
+  if (!AffineWarp::parsePolicy(config.compose_policy, policy)) {
+    LOG(ERROR) << "Unknown compose_policy: " << config.compose_policy << endl;
+    return false;
+  }
+  canvas.setPolicy(policy, config.seam_band);
+  return true;
 }
 
-IncrementalStitcher::Status checkTransform(Mat R, IncrementalStitcher& stitcher, Config& config) {
-  IncrementalStitcher::Status status = IncrementalStitcher::Status::OK;
-  if (abs(R.at<float>(0,2)) > config.image_width/3) {
-    status = IncrementalStitcher::Status::EXCEEDS_X_THRESHOLD_ERR;
-  } else if (abs(R.at<float>(1,2)) > config.image_height/3) {
-    status = IncrementalStitcher::Status::EXCEEDS_X_THRESHOLD_ERR;
-  } else if (abs(angle(R)) > 15.0) {
-    status = IncrementalStitcher::Status::EXCEEDS_X_THRESHOLD_ERR;
+// Rebuild the map from the session journal, without matching.
+int replay(Config& config, float scale) {
+  Journal journal("stitched.journal");
+  if (journal.getStatus() != Journal::Status::OK) {
+    LOG(ERROR) << journal.getError(journal.getStatus()) << endl;
+    return -1;
   }
+  MapBundle bundle("stitched.map", (size_t)config.canvas_memory_mb << 20, true);
+  if (bundle.getStatus() != MapBundle::Status::OK) {
+    LOG(ERROR) << bundle.getError(bundle.getStatus()) << endl;
+    return -1;
+  }
+  bundle.setCalibration(MapBundle::calibrationHash(config));
+  Ptr<MappedTileStore> stamps = bundle.getStampStore();
+  if (stamps->getStatus() != MappedTileStore::Status::OK) {
+    return -1; // Logged by the store.
+  }
+  Canvas canvas(bundle.getStore(), stamps);
+  if (!setPolicy(config, canvas)) {
+    return -1;
+  }
+
+  double t = getTime();
+  int count = journal.replay(canvas, scale);
+  LOG(INFO) << "Replayed " << count << " frames in " << getTime() - t << "s" << endl;
 
-  return status;
+  Image stitchedImg = canvas.preview(600);
+  if (stitchedImg.cols > 0) {
+    imshow("Stitched Image", stitchedImg);
+  }
+  finish(canvas);
+  return 0;
 }
 
 int main( int argc, char** argv ) {
@@ -53,6 +87,10 @@ int main( int argc, char** argv ) {
   namedWindow("Stitched Image");
   moveWindow("Stitched Image", 20,20);
 
+  if (argc > 1 && string(argv[1]) == "--replay") {
+    return replay(config, argc > 2 ? atof(argv[2]) : 1.0);
+  }
+
   Source *source;
   if (argc==1) {
     VideoCapture cap;
@@ -69,9 +107,9 @@ int main( int argc, char** argv ) {
     config.setv4l(); // Exposure settings don't take unless we read some frames first.
     source = new VideoSource(cap);
   } else {
-    vector<UMat> imgs;
+    vector<Image> imgs;
     for(int i=1; i<argc; i++) {
-      UMat img = imread( argv[i]).getUMat(ACCESS_READ);
+      Image img = asImage(imread( argv[i]));
       if (!img.cols) {
 	LOG(ERROR) << "Bad file: " << argv[i] << endl;
 	return -1;
@@ -82,69 +120,108 @@ int main( int argc, char** argv ) {
     source = new ImageSource(imgs);
   }
   
-  IncrementalStitcher stitcher(1.0,
-			       IncrementalStitcher::MatchMode::PAIRWISE,
-			       IncrementalStitcher::DetectMethod::DETECT_SURF,
-			       IncrementalStitcher::ExtractMethod::EXTRACT_FREAK);
-  UMat img1;
+  IncrementalStitcher stitcher(config, IncrementalStitcher::MatchMode::PAIRWISE);
+  // Stitch into a memory-mapped map bundle so large scans don't have to fit in RAM.
+  MapBundle bundle("stitched.map", (size_t)config.canvas_memory_mb << 20, true);
+  if (bundle.getStatus() != MapBundle::Status::OK) {
+    LOG(ERROR) << bundle.getError(bundle.getStatus()) << endl;
+    return -1;
+  }
+  bundle.setCalibration(MapBundle::calibrationHash(config));
+  Ptr<MappedTileStore> stamps = bundle.getStampStore();
+  if (stamps->getStatus() != MappedTileStore::Status::OK) {
+    return -1; // Logged by the store.
+  }
+  stitcher.setCanvas(Canvas(bundle.getStore(), stamps));
+  if (!setPolicy(config, stitcher.getCanvas())) {
+    return -1;
+  }
+
+  // Journal every frame, so the session can be recovered or re-rendered with --replay.
+  Journal journal("stitched.journal", true);
+  if (journal.getStatus() != Journal::Status::OK) {
+    LOG(ERROR) << journal.getError(journal.getStatus()) << endl;
+  }
+
+  Image img1;
   Markers::Status status = Markers::Status::ERR;
   while (status != Markers::Status::OK) {
     status = source->nextImage(markers, img1);
     if (status != Markers::Status::OK) {
-      UMat dummy = UMat::zeros(600, 600, CV_8UC3);
+      Image dummy = Image::zeros(600, 600, CV_8UC3);
       showError(markers.getError(status), dummy);
       imshow("Stitched Image", dummy);
       key = waitKey(100);
     }
   }
+
+  // The first frame is the canvas origin.
+  int seq = 0;
+  JournalRecord first = {seq++, 1, 0, 0, getTime(), 0, 0, 0, {1, 0, 0, 0, 1, 0}};
+  journal.append(first, img1);
   
   double t1, dt;
-  int seq = 0;
   while (!source->done()) {
-    UMat img2;
+    Image img2;
+    JournalRecord r = {seq++, 0, 0, 0, getTime(), 0, 0, 0, {0, 0, 0, 0, 0, 0}};
     t1 = getTime();
     status = source->nextImage(markers, img2);
+    stitcher.setFrameId(source->getFrameId());
+    stitcher.setFrameTime(source->getFrameTime());
     dt = (getTime() - t1);
+    r.acquireTime = dt;
+    r.markerStatus = status;
     LOG(INFO) << "AM Time: " << dt << endl;
 
-    UMat stitchedImg;
+    string error;
     if (status == 0) {
-      Mat R;
-      t1 = getTime();
-      IncrementalStitcher::Status status = stitcher.detectAndMatch(img1, img2, R);
-      dt = (getTime() - t1);
-      dmtime.push_back(dt);
-      LOG(INFO) << "DM Time: " << dt << endl;
-      if (status == IncrementalStitcher::Status::OK &&
-	  checkTransform(R, stitcher, config) == IncrementalStitcher::Status::OK) {
-	stitcher.composeImages(img1, img2, R);
-	stitcher.getNextBaseImage().copyTo(img1);
-	stitchedImg = stitcher.getStitchedImage();
-      } else {
-	stitcher.getStitchedImage().copyTo(stitchedImg);
-	showError(stitcher.getError(status), stitchedImg);
+      IncrementalStitcher::FrameResult result;
+      IncrementalStitcher::Status status =
+	stitcher.stitchFrame(img1, img2, Size(config.image_width, config.image_height), result);
+      r.matchTime = result.matchTime;
+      r.composeTime = result.composeTime;
+      LOG(INFO) << "DM Time: " << result.matchTime << endl;
+      r.stitchStatus = status;
+      // Only composed frames are journaled as accepted; replay composes just those.
+      if (result.composed) {
+	r.accepted = 1;
+	for (int i=0; i<6; i++) {
+	  r.pose[i] = result.pose.val[i];
+	}
+      } else if (status != IncrementalStitcher::Status::OK) {
+	error = stitcher.getError(status);
       }
     } else {
-      stitcher.getStitchedImage().copyTo(stitchedImg);
-      showError(markers.getError(status), stitchedImg);
+      error = markers.getError(status);
     }
+    journal.append(r, img2);
 
-    if (stitchedImg.cols > 0) {
-      imshow("Stitched Image", imscale(600, stitchedImg));
+    {
+      ScopedTimer timer(Profiler::DISPLAY);
+      Image stitchedImg = stitcher.getCanvas().preview(600);
+      if (stitchedImg.cols > 0) {
+	if (!error.empty()) {
+	  showError(error, stitchedImg);
+	}
+	imshow("Stitched Image", stitchedImg);
+      } else if (!error.empty()) {
+	LOG(ERROR) << error << endl;
+      }
     }
     
     // Pause for any drawing to catch up.
     key = waitKey(100);
     if (key == 27) {
       break;
+    } else if (key == 't') {
+      Profiler::dump();
     }
   }
   LOG(INFO) << "done" << endl;
-  stats();
-  imwrite("stitched.jpeg", stitcher.getStitchedImage());
-  LOG(INFO) << "Wrote file." << endl;
-  key = (char) waitKey(0);
-  
+  Profiler::dump();
+  source->logCounts(markers);
+  finish(stitcher.getCanvas());
+
   return 0;
 }
 
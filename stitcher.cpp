@@ -1,10 +1,52 @@
 #include "stitcher.hpp"
+#include "config.hpp"
 #include "opencv2/features2d/features2d.hpp"
+#include <float.h>
+#include <algorithm>
 
 using namespace std;
 using namespace cv;
 using namespace detail;
 
+KeyPointGrid::KeyPointGrid(const vector<KeyPoint>& keypoints, Size size, int _cellSize) {
+  cellSize = _cellSize;
+  cols = size.width / cellSize + 1;
+  rows = size.height / cellSize + 1;
+
+  // Counting sort of keypoints into cells.
+  vector<int> cell(keypoints.size());
+  cellStart.assign(cols*rows + 1, 0);
+  for (int i=0; i<keypoints.size(); i++) {
+    int cx = std::min(std::max((int)(keypoints[i].pt.x / cellSize), 0), cols-1);
+    int cy = std::min(std::max((int)(keypoints[i].pt.y / cellSize), 0), rows-1);
+    cell[i] = cy*cols + cx;
+    cellStart[cell[i]+1]++;
+  }
+  for (int i=0; i<cols*rows; i++) {
+    cellStart[i+1] += cellStart[i];
+  }
+  vector<int> pos(cellStart.begin(), cellStart.end()-1);
+  cellIndices.resize(keypoints.size());
+  for (int i=0; i<keypoints.size(); i++) {
+    cellIndices[pos[cell[i]]++] = i;
+  }
+}
+
+void KeyPointGrid::query(Point2f pt, float radius, vector<int>& indices) const {
+  indices.clear();
+  int x0 = std::max((int)floor((pt.x - radius) / cellSize), 0);
+  int y0 = std::max((int)floor((pt.y - radius) / cellSize), 0);
+  int x1 = std::min((int)floor((pt.x + radius) / cellSize), cols-1);
+  int y1 = std::min((int)floor((pt.y + radius) / cellSize), rows-1);
+  for (int cy=y0; cy<=y1; cy++) {
+    for (int cx=x0; cx<=x1; cx++) {
+      int c = cy*cols + cx;
+      indices.insert(indices.end(), cellIndices.begin() + cellStart[c],
+		     cellIndices.begin() + cellStart[c+1]);
+    }
+  }
+}
+
 IncrementalStitcher::IncrementalStitcher(float _matchScale, MatchMode _matchMode,
 					 DetectMethod _detectMethod,
 					 ExtractMethod _extractMethod) {
@@ -13,12 +55,22 @@ IncrementalStitcher::IncrementalStitcher(float _matchScale, MatchMode _matchMode
   detectMethod = _detectMethod;
   extractMethod = _extractMethod;
 
+  // Frames get their own detector, whose threshold adapts; keep a typed handle on it.
+  hessianThreshold = minHessian;
   if (detectMethod==DetectMethod::DETECT_ORB) {
-    detector = ORB::create(maxDetectPoints, 1.5f, 5);
+    Ptr<ORB> orb = ORB::create(maxDetectPoints, 1.5f, 5);
+    orb->setFastThreshold(fastThreshold);
+    detector = orb;
+    orbDetector = ORB::create(maxDetectPoints, 1.5f, 5);
+    orbDetector->setFastThreshold(fastThreshold);
+    frameDetector = orbDetector;
   } else if (detectMethod==DetectMethod::DETECT_SIFT) {
     detector = xfeatures2d::SIFT::create();
+    frameDetector = detector;
   } else {
-    detector = xfeatures2d::SURF::create(minHessian, 3, 4, false, true);
+    detector = xfeatures2d::SURF::create(hessianThreshold, 3, 4, false, true);
+    surfDetector = xfeatures2d::SURF::create(hessianThreshold, 3, 4, false, true);
+    frameDetector = surfDetector;
   }
 
   if (extractMethod==ExtractMethod::EXTRACT_ORB) {
@@ -32,108 +84,393 @@ IncrementalStitcher::IncrementalStitcher(float _matchScale, MatchMode _matchMode
   }
 }
 
-IncrementalStitcher::Status IncrementalStitcher::detectAndMatch(UMat img1, UMat img2,
+static const char* DETECT_NAMES[] = {"surf", "orb", "sift"};
+
+static const char* EXTRACT_NAMES[] = {"surf", "orb", "freak", "brisk"};
+
+static IncrementalStitcher::DetectMethod detectMethodFor(const string& name) {
+  IncrementalStitcher::DetectMethod method = IncrementalStitcher::DetectMethod::DETECT_SURF;
+  if (!IncrementalStitcher::parseDetectMethod(name, method)) {
+    LOG(ERROR) << "Unknown detect_method: " << name << endl;
+  }
+  return method;
+}
+
+static IncrementalStitcher::ExtractMethod extractMethodFor(const string& name) {
+  IncrementalStitcher::ExtractMethod method = IncrementalStitcher::ExtractMethod::EXTRACT_FREAK;
+  if (!IncrementalStitcher::parseExtractMethod(name, method)) {
+    LOG(ERROR) << "Unknown extract_method: " << name << endl;
+  }
+  return method;
+}
+
+IncrementalStitcher::IncrementalStitcher(const Config& config, MatchMode _matchMode)
+  : IncrementalStitcher(config.match_scale, _matchMode, detectMethodFor(config.detect_method),
+			extractMethodFor(config.extract_method)) {
+}
+
+bool IncrementalStitcher::parseDetectMethod(const string& name, DetectMethod& method) {
+  for (int i=0; i<sizeof(DETECT_NAMES)/sizeof(DETECT_NAMES[0]); i++) {
+    if (name == DETECT_NAMES[i]) {
+      method = (DetectMethod)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool IncrementalStitcher::parseExtractMethod(const string& name, ExtractMethod& method) {
+  for (int i=0; i<sizeof(EXTRACT_NAMES)/sizeof(EXTRACT_NAMES[0]); i++) {
+    if (name == EXTRACT_NAMES[i]) {
+      method = (ExtractMethod)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char* IncrementalStitcher::detectMethodName(DetectMethod method) {
+  return DETECT_NAMES[method];
+}
+
+const char* IncrementalStitcher::extractMethodName(ExtractMethod method) {
+  return EXTRACT_NAMES[method];
+}
+
+IncrementalStitcher::Status IncrementalStitcher::detectAndMatch(Image img1, Image img2,
 								Mat& R) {
-  vector<UMat> imgs;
-  imgs.push_back(img1);
-  imgs.push_back(img2);
+  FrameScope frame(frameId);
+  ImageFeatures f0;
+  detectFeatures(img1, f0);
+  return detectAndMatch(f0, img2, R);
+}
+
+IncrementalStitcher::Status IncrementalStitcher::detectAndMatch(const ImageFeatures& f0,
+								Image img2, Mat& R) {
+  FrameScope frame(frameId);
+  // Predict this frame's transform from recent motion. The model is kept at full
+  // resolution, so scale the translation to match resolution. Time it by capture, so
+  // replays predict the same however fast the host is.
+  double now = frameTime >= 0 ? frameTime : getTime();
+  hasPrediction = useMotionPrior && predict(now, prediction);
+  if (hasPrediction) {
+    prediction(0,2) *= matchScale;
+    prediction(1,2) *= matchScale;
+  }
+
+  // Keypoint budgets are per frame, so size the buckets from the frame rather than the
+  // base, which may be the whole canvas.
+  frameArea = img2.cols*matchScale * img2.rows*matchScale;
+  ImageFeatures f1;
+  detectFeatures(img2, f1, frameDetector);
+  f1.img_idx = 1;
+  adaptThreshold(detectedKeypoints);
 
-  Mat stitched;
   IncrementalStitcher::Status status;
-  if ((status = matchImages(imgs)) != Status::OK) {
+  if ((status = matchFeatures(f0, f1)) != Status::OK) {
     return status;
   }
 
   matches_.H.convertTo(R, CV_32F);
   LOG(INFO) << R << endl;
+
+  Matx33f pose = R;
+  pose(0,2) /= matchScale;
+  pose(1,2) /= matchScale;
+  updateMotion(pose, now);
   return Status::OK;
 }
 
+IncrementalStitcher::Status IncrementalStitcher::verifyMatch(const ImageFeatures& f0,
+							     const ImageFeatures& f1, Mat& R,
+							     double* confidence) const {
+  FrameScope frame(frameId);
+  ImageFeatures frameFeatures = f1;
+  frameFeatures.img_idx = 1;
+  MatchesInfo info;
+  IncrementalStitcher::Status status = matchPair(f0, frameFeatures, NULL, info);
+  if (confidence != NULL) {
+    *confidence = info.confidence;
+  }
+  if (status != Status::OK) {
+    return status;
+  }
+  info.H.convertTo(R, CV_32F);
+  return Status::OK;
+}
+
+void IncrementalStitcher::setMotionPrior(bool enable) {
+  useMotionPrior = enable;
+}
+
+void IncrementalStitcher::resetMotion() {
+  hasPose = false;
+  hasMotion = false;
+}
+
+bool IncrementalStitcher::predict(double t, Matx33f& R) {
+  if (!hasPose || !hasMotion || t - lastPoseTime > maxPredictAge) {
+    return false;
+  }
+
+  // Extrapolate the last frame-to-frame motion over the elapsed time. Rotation and
+  // translation are scaled independently, which is fine for small inter-frame motion.
+  float k = (float)((t - lastPoseTime) / lastMotionDt);
+  k = std::min(k, 3.0f);
+  float theta = atan2(lastMotion(1,0), lastMotion(0,0)) * k;
+  Matx33f M(cos(theta), -sin(theta), lastMotion(0,2) * k,
+	    sin(theta),  cos(theta), lastMotion(1,2) * k,
+	    0.0f,        0.0f,       1.0f);
+  R = M * lastPose;
+  return true;
+}
+
+void IncrementalStitcher::updateMotion(const Matx33f& R, double t) {
+  if (hasPose && t > lastPoseTime) {
+    lastMotion = R * lastPose.inv();
+    lastMotionDt = t - lastPoseTime;
+    hasMotion = true;
+  }
+  lastPose = R;
+  lastPoseTime = t;
+  hasPose = true;
+}
+
+void IncrementalStitcher::guidedMatch(const ImageFeatures& f0, const ImageFeatures& f1,
+				      const Matx33f& prior, MatchesInfo& info) const {
+  info = MatchesInfo();
+  info.src_img_idx = 0;
+  info.dst_img_idx = 1;
+  if (f0.keypoints.empty() || f1.keypoints.empty()) {
+    return;
+  }
+
+  Mat d0 = f0.descriptors.getMat(ACCESS_READ);
+  Mat d1 = f1.descriptors.getMat(ACCESS_READ);
+  int normType = d0.depth() == CV_8U ? NORM_HAMMING : NORM_L2;
+  const float matchConf = 0.3f; // Same ratio test as AffineBestOf2NearestMatcher.
+
+  ScopedTimer matchTimer(Profiler::MATCH);
+  KeyPointGrid index(f0.keypoints, f0.img_size, (int)priorRadius);
+  Matx33f inv = prior.inv();
+  vector<int> candidates;
+  for (int j=0; j<f1.keypoints.size(); j++) {
+    // Predicted location of this frame keypoint in the base image.
+    Point3f p = inv * f1.keypoints[j].pt;
+    index.query(Point2f(p.x, p.y), priorRadius, candidates);
+
+    int best = -1;
+    double d1st = DBL_MAX, d2nd = DBL_MAX;
+    for (int c=0; c<candidates.size(); c++) {
+      double d = norm(d0.row(candidates[c]), d1.row(j), normType);
+      if (d < d1st) {
+	d2nd = d1st;
+	d1st = d;
+	best = candidates[c];
+      } else if (d < d2nd) {
+	d2nd = d;
+      }
+    }
+    if (best >= 0 && d1st < (1.0f - matchConf) * d2nd) {
+      info.matches.push_back(DMatch(best, j, (float)d1st));
+    }
+  }
+
+  matchTimer.stop();
+  if (info.matches.size() < 6) {
+    return;
+  }
+
+  ScopedTimer estimateTimer(Profiler::ESTIMATE);
+  Mat src_points(1, (int)info.matches.size(), CV_32FC2);
+  Mat dst_points(1, (int)info.matches.size(), CV_32FC2);
+  for (int i=0; i<info.matches.size(); i++) {
+    src_points.at<Point2f>(0, i) = f0.keypoints[info.matches[i].queryIdx].pt;
+    dst_points.at<Point2f>(0, i) = f1.keypoints[info.matches[i].trainIdx].pt;
+  }
+  Mat H = estimateAffinePartial2D(src_points, dst_points, info.inliers_mask);
+  if (H.empty()) {
+    return;
+  }
+
+  info.num_inliers = 0;
+  for (int i=0; i<info.inliers_mask.size(); i++) {
+    if (info.inliers_mask[i]) info.num_inliers++;
+  }
+  info.confidence = info.num_inliers / (8 + 0.3 * info.matches.size());
+
+  H.push_back(Mat::zeros(1, 3, CV_64F));
+  H.at<double>(2, 2) = 1;
+  info.H = H;
+}
+
+void IncrementalStitcher::detectFeatures(Image img, ImageFeatures& features) {
+  detectFeatures(img, features, detector);
+}
+
+void IncrementalStitcher::detectFeatures(Image img, ImageFeatures& features,
+					 Ptr<Feature2D> detector) {
+  FramePool& pool = FramePool::shared();
+  if (matchScale != 1.0) {
+    Size size(img.cols*matchScale, img.rows*matchScale);
+    Image tmpImg = pool.getImage(size, img.type());
+    resize(img, tmpImg, size, 0, 0, INTER_AREA);
+    img = tmpImg;
+  }
+
+  // Create mask for image.
+  ScopedTimer maskTimer(Profiler::MASK);
+  Mat gray_img = pool.getMat(img.size(), CV_8U);
+  Mat dmask = pool.getMat(img.size(), CV_8U);
+  cvtColor(img, gray_img, CV_BGR2GRAY);
+  featureMask(gray_img, dmask);
+  maskTimer.stop();
+
+  // Detect straight into features, rather than copying the keypoints in afterwards.
+  UMat descriptors; // ImageFeatures keeps descriptors as a UMat.
+  {
+    ScopedTimer timer(Profiler::DETECT);
+    detector->detect(asMat(img), features.keypoints, dmask);
+    detectedKeypoints = features.keypoints.size();
+    double area = frameArea > 0 ? frameArea : (double)img.cols * img.rows;
+    int cap = std::max(1, cvCeil(targetKeypoints * bucketSize * bucketSize / area));
+    bucketKeypoints(features.keypoints, bucketSize, cap);
+  }
+
+  ScopedTimer extractTimer(Profiler::EXTRACT);
+  if (true || extractMethod==ExtractMethod::EXTRACT_FREAK) {
+    extractor->compute(gray_img, features.keypoints, descriptors);
+  } else {
+    extractor->compute(img, features.keypoints, descriptors);
+  }
+
+  features.img_idx = 0;
+  features.img_size = Size(img.cols, img.rows);
+  features.descriptors = descriptors;
+}
+
+static bool strongerKeypoint(const KeyPoint& a, const KeyPoint& b) {
+  return a.response > b.response;
+}
+
+void IncrementalStitcher::bucketKeypoints(vector<KeyPoint>& keypoints, int cellSize, int cap) {
+  // Strongest first, then keep the first cap that land in each cell.
+  std::stable_sort(keypoints.begin(), keypoints.end(), strongerKeypoint);
+  map<pair<int, int>, int> counts;
+  int kept = 0;
+  for (int i=0; i<keypoints.size(); i++) {
+    pair<int, int> cell((int)floor(keypoints[i].pt.x / cellSize),
+			(int)floor(keypoints[i].pt.y / cellSize));
+    if (counts[cell]++ < cap) {
+      keypoints[kept++] = keypoints[i];
+    }
+  }
+  keypoints.resize(kept);
+}
+
+void IncrementalStitcher::adaptThreshold(int detected) {
+  // Counts fall roughly in inverse proportion to the threshold, so scale it by how far off
+  // the count was, damped and limited so one odd frame can't swing it far. Detect a
+  // margin over the target so bucketing has some to choose from. Counts within the
+  // deadband leave it alone, so it settles instead of chasing every frame.
+  double ratio = (double)detected / (targetKeypoints * detectMargin);
+  double step = pow(std::min(std::max(ratio, 0.5), 2.0), adaptGain);
+  bool off = ratio < 1 - adaptDeadband || ratio > 1 + adaptDeadband;
+  if (surfDetector && off) {
+    hessianThreshold = std::min(std::max(hessianThreshold * step, 50.0), 5000.0);
+    surfDetector->setHessianThreshold(hessianThreshold);
+  } else if (orbDetector && off && detected < maxDetectPoints) {
+    // ORB keeps its strongest maxDetectPoints, so a capped count doesn't say how far over
+    // the threshold is; only a shortfall moves it. Move at least one step, or rounding
+    // can hold it in place.
+    int moved = cvRound(fastThreshold * step);
+    if (moved == fastThreshold) {
+      moved += ratio < 1 ? -1 : 1;
+    }
+    fastThreshold = std::min(std::max(moved, 5), 60);
+    orbDetector->setFastThreshold(fastThreshold);
+  }
+  LOG(INFO) << "Keypoints: " << detected << "  hessian: " << hessianThreshold << "  fast: "
+	    << fastThreshold << endl;
+}
+
 IncrementalStitcher::Status IncrementalStitcher::matchImages(InputArrayOfArrays images,
 							     bool showMatches) {
-  Status status = Status::OK;
-  vector<UMat> imgs;
+  vector<Image> imgs;
+#ifdef HANDICAM_CPU_MAT
+  images.getMatVector(imgs);
+#else
   images.getUMatVector(imgs);
+#endif
   CV_Assert(imgs.size() == 2);
 
-  if (matchScale != 1.0) {
+  ImageFeatures f0, f1;
+  detectFeatures(imgs[0], f0);
+  detectFeatures(imgs[1], f1);
+  f1.img_idx = 1;
+  Status status = matchFeatures(f0, f1);
+
+  // Optionally, draw matches.
+  if (showMatches) {
     for (int i=0; i<imgs.size(); i++) {
-      UMat tmpImg;
+      Image tmpImg;
       resize(imgs[i], tmpImg, Size(imgs[i].cols*matchScale, imgs[i].rows*matchScale),
 	     0, 0, INTER_AREA);
       imgs[i] = tmpImg;
     }
+    vector<uchar> umask = matches_.inliers_mask;
+    vector<char> mask = std::vector<char>( umask.begin(), umask.end() );
+    Mat drawing;
+    drawMatches(imgs[0], f0.keypoints, imgs[1], f1.keypoints, matches_.matches, drawing,
+		Scalar::all(-1), Scalar::all(-1), mask);
+    imshow("Matches", imscale(1000, drawing));
   }
-  
-  // Create masks for images.
-  Mat gray_img0, mask0;
-  cvtColor(imgs[0], gray_img0, CV_BGR2GRAY);
-  threshold(gray_img0, mask0, 10, 255, THRESH_BINARY);
-
-  Mat gray_img1, mask1;
-  cvtColor(imgs[1], gray_img1, CV_BGR2GRAY);
-  threshold(gray_img1, mask1, 10, 255, THRESH_BINARY);
-
-  // Erode some of our image masks so that feature detection doesn't identify mask edges
-  // as features.
-  int erosion_size = 50;
-  Mat elem = getStructuringElement(MORPH_RECT,
-				   Size(2*erosion_size + 1, 2*erosion_size+1),
-				   Point(erosion_size, erosion_size));
-  Mat dmask0, dmask1;
-  erode(mask0, dmask0, elem);
-  erode(mask1, dmask1, elem);
-
-  vector<KeyPoint> keypoints_1, keypoints_2;
-  UMat descriptors_1, descriptors_2;
-
-  detector->detect(imgs[0].getMat(ACCESS_READ), keypoints_1, dmask0);
-  detector->detect(imgs[1].getMat(ACCESS_READ), keypoints_2, dmask1);
+  return status;
+}
 
-  if (true || extractMethod==ExtractMethod::EXTRACT_FREAK) {
-    extractor->compute(gray_img0, keypoints_1, descriptors_1);
-    extractor->compute(gray_img1, keypoints_2, descriptors_2);
-  } else {
-    extractor->compute(imgs[0], keypoints_1, descriptors_1);
-    extractor->compute(imgs[1], keypoints_2, descriptors_2);
-  }
-
-  // Prepare structures for matcher.
-  detail::ImageFeatures f0 = {
-    0,                                // img_idx
-    Size(imgs[0].cols, imgs[0].rows), // img_size
-    keypoints_1,                      // keypoints
-    descriptors_1                     // descriptors
-  };
-
-  detail::ImageFeatures f1 = {
-    1,                                // img_idx
-    Size(imgs[1].cols, imgs[1].rows), // img_size
-    keypoints_2,                      // keypoints
-    descriptors_2                     // descriptors
-  };
-
-  features_.clear();
-  features_.push_back(f0);
-  features_.push_back(f1);
-
-  LOG(INFO) << "KeyPoints 1: " << keypoints_1.size() << "  2: " << keypoints_2.size() << endl;
+IncrementalStitcher::Status IncrementalStitcher::matchFeatures(const ImageFeatures& f0,
+							       const ImageFeatures& f1) {
+  return matchPair(f0, f1, hasPrediction ? &prediction : NULL, matches_);
+}
+
+IncrementalStitcher::Status IncrementalStitcher::matchPair(const ImageFeatures& f0,
+							   const ImageFeatures& f1,
+							   const Matx33f* prior,
+							   MatchesInfo& info) const {
+  Status status = Status::OK;
+
+  LOG(INFO) << "KeyPoints 1: " << f0.keypoints.size() << "  2: " << f1.keypoints.size()
+	    << endl;
   
-  // Match.
-  vector<cv::detail::MatchesInfo> pairwise_matches_;
-  detail::AffineBestOf2NearestMatcher(false, true, 0.3f)(features_, pairwise_matches_);
-  matches_ = pairwise_matches_[1];
-  //affineMatch(f0, f1, matches_);
-
-  LOG(INFO) << "Matches: " << matches_.num_inliers << endl;
-  LOG(INFO) << "Confidence: " << matches_.confidence << endl;
-  if (matches_.num_inliers < 1) {
+  // Match. With a motion prior, only compare descriptors near each keypoint's predicted
+  // location. Fall back to exhaustive matching if that doesn't hold up.
+  bool guided = false;
+  if (prior != NULL) {
+    guidedMatch(f0, f1, *prior, info);
+    guided = info.num_inliers >= minPriorInliers;
+    LOG(INFO) << "Guided matches: " << info.num_inliers << endl;
+  }
+  if (!guided) {
+    // Matching and estimation are one call here, so both count as matching.
+    ScopedTimer timer(Profiler::MATCH);
+    vector<cv::detail::ImageFeatures> features;
+    features.push_back(f0);
+    features.push_back(f1);
+    vector<cv::detail::MatchesInfo> pairwiseMatches;
+    detail::AffineBestOf2NearestMatcher(false, true, 0.3f)(features, pairwiseMatches);
+    info = pairwiseMatches[1];
+    //affineMatch(f0, f1, info);
+  }
+
+  LOG(INFO) << "Matches: " << info.num_inliers << endl;
+  LOG(INFO) << "Confidence: " << info.confidence << endl;
+  if (info.num_inliers < 1) {
     status = Status::TOO_FEW_MATCHES_ERR;
   }
 
   Mat R;
-  if (matches_.H.rows > 0) {
-    matches_.H.convertTo(R, CV_32F);
+  if (info.H.rows > 0) {
+    info.H.convertTo(R, CV_32F);
     if (abs(1-getScale(R)) > matchScaleThreshold) {
       LOG(INFO) << "Affine transform scale: " << getScale(R) << endl;
       status = Status::EXCEEDS_SCALE_THRESHOLD_ERR;
@@ -141,36 +478,9 @@ IncrementalStitcher::Status IncrementalStitcher::matchImages(InputArrayOfArrays
   } else {
     status = Status::TOO_FEW_MATCHES_ERR;
   }
-
-  // Optionally, draw matches.
-  if (showMatches) {
-    vector<uchar> umask = matches_.inliers_mask;
-    vector<char> mask = std::vector<char>( umask.begin(), umask.end() );
-    Mat drawing;
-    drawMatches(imgs[0], keypoints_1, imgs[1], keypoints_2, matches_.matches, drawing,
-		Scalar::all(-1), Scalar::all(-1), mask);
-    imshow("Matches", imscale(1000, drawing));
-  }
   return status;
 }
 
-void IncrementalStitcher::translate(float x, float y) {
-  // In pairwise mode, track changes to cordinate system independently.
-  if (matchMode == MatchMode::PAIRWISE) {
-    gx = (x+dx) < 0 ? (x+dx)*-1.0 : 0;
-    gy = (y+dy) < 0 ? (y+dy)*-1.0 : 0;
-    dx = (x+dx) > 0 ? (x+dx) : 0;
-    dy = (y+dy) > 0 ? (y+dy) : 0;
-  } else {
-    gx = (x) < 0 ? (x)*-1.0 : 0;
-    gy = (y) < 0 ? (y)*-1.0 : 0;
-    dx = (x) > 0 ? (x) : 0;
-    dy = (y) > 0 ? (y) : 0;
-  }
-  LOG(INFO) << "gx: " << gx << "\t" << "dx: " << dx << endl;
-  LOG(INFO) << "gy: " << gy << "\t" << "dy: " << dy << endl;
-}
-
 float scale(Mat H) {
   CV_Assert(H.type() == CV_32F);
   float a = H.at<float>(0,0);
@@ -186,50 +496,181 @@ void undoScale(Mat H, float scale) {
   H.at<float>(1,1) = H.at<float>(1,1) / scale;
 }
 
-UMat IncrementalStitcher::getStitchedImage() {
-  return stitchedImage;
+Image IncrementalStitcher::getStitchedImage() {
+  return canvas.toImage();
+}
+
+Canvas& IncrementalStitcher::getCanvas() {
+  return canvas;
 }
 
-UMat IncrementalStitcher::getNextBaseImage() {
+void IncrementalStitcher::setCanvas(const Canvas& _canvas) {
+  canvas = _canvas;
+}
+
+// Gray copy of img, halved level times.
+static Mat grayLevel(Image img, int level) {
+  Mat gray;
+  if (img.channels() == 1) {
+    asMat(img).copyTo(gray);
+  } else {
+    cvtColor(asMat(img), gray, COLOR_BGR2GRAY);
+  }
+  for (int i=0; i<level; i++) {
+    pyrDown(gray, gray);
+  }
+  return gray;
+}
+
+IncrementalStitcher::Status IncrementalStitcher::refine(Image base, Image img, Mat& R,
+							double& error) const {
+  FrameScope frame(frameId);
+  ScopedTimer timer(Profiler::REFINE);
+  // ECC's Euclidean model has no scale, so start from R without it.
+  Matx33f H = R;
+  float s = getScale(H);
+  Mat W(Matx23f(H(0,0)/s, H(0,1)/s, H(0,2), H(1,0)/s, H(1,1)/s, H(1,2)));
+
+  TermCriteria criteria(TermCriteria::COUNT + TermCriteria::EPS, refineIterations,
+			refineEpsilon);
+  Mat b, f, mask;
+  double rho = 0;
+  for (int level=refineCoarsestLevel; level>=refineFinestLevel; level--) {
+    float d = 1 << level;
+    b = grayLevel(base, level);
+    f = grayLevel(img, level);
+    // Ignore the frame's black border, and a little inside it where pyrDown blurred it.
+    threshold(f, mask, 10, 255, THRESH_BINARY);
+    erode(mask, mask, Mat(), Point(-1, -1), 2);
+    W.at<float>(0,2) /= d;
+    W.at<float>(1,2) /= d;
+    try {
+      rho = findTransformECC(b, f, W, MOTION_EUCLIDEAN, criteria, mask);
+    } catch (cv::Exception& e) {
+      LOG(INFO) << "ECC failed: " << e.what() << endl;
+      return Status::REFINE_ERR;
+    }
+    W.at<float>(0,2) *= d;
+    W.at<float>(1,2) *= d;
+  }
+
+  // The residual left once frame intensities are fit to base's is var(base) * (1 - rho^2).
+  // A translation is pinned down by base's gradients, so its variance along x is that over
+  // the sum of squared x gradients, and likewise for y.
+  float d = 1 << refineFinestLevel;
+  Mat Wl = W.clone();
+  Wl.at<float>(0,2) /= d;
+  Wl.at<float>(1,2) /= d;
+  Mat valid;
+  warpAffine(mask, valid, Wl, b.size(), INTER_NEAREST | WARP_INVERSE_MAP);
+  Scalar mean, stddev;
+  meanStdDev(b, mean, stddev, valid);
+  double residual = stddev[0]*stddev[0] * std::max(0.0, 1 - rho*rho);
+  Mat gx, gy;
+  Sobel(b, gx, CV_32F, 1, 0, 3, 1.0/8);
+  Sobel(b, gy, CV_32F, 0, 1, 3, 1.0/8);
+  double sx = norm(gx, NORM_L2SQR, valid);
+  double sy = norm(gy, NORM_L2SQR, valid);
+  error = sx > 0 && sy > 0 ? sqrt(residual / std::min(sx, sy)) * d : INFINITY;
+  error = std::max(error, refineErrorFloor);
+  LOG(INFO) << "ECC rho: " << rho << "  error: " << error << "px" << endl;
+
+  Mat refined = Mat::eye(3, 3, CV_32F);
+  W.copyTo(refined.rowRange(0, 2));
+  R = refined;
+  return Status::OK;
+}
+
+void IncrementalStitcher::featureMask(const Mat& gray, Mat& mask) {
+  Mat imgMask = FramePool::shared().getMat(gray.size(), CV_8U);
+  threshold(gray, imgMask, 10, 255, THRESH_BINARY);
+
+  // Erode the image mask so that feature detection doesn't identify mask edges as
+  // features.
+  const int erosion_size = 50;
+  static const Mat elem = getStructuringElement(MORPH_RECT,
+						Size(2*erosion_size + 1, 2*erosion_size+1),
+						Point(erosion_size, erosion_size));
+  erode(imgMask, mask, elem);
+}
+
+float IncrementalStitcher::getMatchScale() {
+  return matchScale;
+}
+
+IncrementalStitcher::DetectMethod IncrementalStitcher::getDetectMethod() {
+  return detectMethod;
+}
+
+IncrementalStitcher::ExtractMethod IncrementalStitcher::getExtractMethod() {
+  return extractMethod;
+}
+
+Matx33f IncrementalStitcher::getFramePose() {
+  return framePose;
+}
+
+void IncrementalStitcher::setFrameId(int64_t frame) {
+  frameId = frame;
+}
+
+void IncrementalStitcher::setFrameTime(double t) {
+  frameTime = t;
+}
+
+Image IncrementalStitcher::getNextBaseImage() {
   if (matchMode == MatchMode::PAIRWISE) {
     return lastMatchedImage;
   } else {
-    return stitchedImage;
+    return canvas.toImage();
   }
 }
 
-IncrementalStitcher::Status IncrementalStitcher::composeImages(UMat img1, UMat img2,
+IncrementalStitcher::Status IncrementalStitcher::composeImages(Image img1, Image img2,
 							       Mat& R) {
-  // Warp the current image mask.
-  UMat mask;
-  mask.create(img2.size(), CV_8U);
-  mask.setTo(Scalar::all(255));
+  FrameScope frame(frameId);
+  ScopedTimer timer(Profiler::COMPOSE);
 
   if (matchScale != 1.0) {
     R.at<float>(0,2) /= matchScale;
     R.at<float>(1,2) /= matchScale;
   }
   
-  Ptr<WarperCreator> wc = new cv::AffineWarper();
-  Ptr<detail::RotationWarper> w = wc->create(1.0);
-
-  UMat wimg2, wmask;
-  Mat_<float> K = Mat::eye(3, 3, CV_32F);
-  
   float s = scale(R);
   if (s != 0) { // TODO: Make this an assertion. Scale variance should have been handled earlier.
     undoScale(R, s);
-    Point tl = w->warp(img2, K, R, INTER_AREA, BORDER_REFLECT, wimg2);
-    w->warp(mask, K, R, INTER_NEAREST, BORDER_CONSTANT, wmask);
 
-    if (stitchedImage.cols==0) img1.copyTo(stitchedImage);
-    translate(tl.x, tl.y);
-    UMat buff = composeImagesWithOffset(stitchedImage, wimg2, wmask,
-					Point(dx, dy), Point(gx, gy));
-    buff.copyTo(stitchedImage);
+    if (canvas.empty()) {
+      canvas.compose(img1, Point(0, 0));
+      basePos = Point(0, 0);
+    }
 
-    lastMatchedImage = UMat::ones(wimg2.rows, wimg2.cols, CV_8UC3 );
-    wimg2.copyTo(lastMatchedImage, wmask);
+    // In pairwise mode the base is the last warped frame; in aggregate mode it's the
+    // whole canvas, so its origin is the canvas top-left.
+    Point oldBase = matchMode == MatchMode::PAIRWISE ? basePos : canvas.bounds().tl();
+    // R maps the base image to the frame, so the frame is warped through its inverse.
+    Matx33f pose = R;
+    Matx33f toFrame = pose * Matx33f(1, 0, -oldBase.x, 0, 1, -oldBase.y, 0, 0, 1);
+    Mat src = asMat(img2);
+    AffineWarp warp(src, toFrame.get_minor<2, 3>(0, 0), true);
+    Point pos = warp.bounds().tl();
+    canvas.compose(warp);
+    Point newBase = matchMode == MatchMode::PAIRWISE ? pos : canvas.bounds().tl();
+    LOG(INFO) << "Composed at: " << pos << "  bounds: " << canvas.bounds() << endl;
+
+    // The next base image has a new coordinate system; re-express the last pose in it.
+    Point shift = newBase - oldBase;
+    lastPose = pose * Matx33f(1, 0, shift.x, 0, 1, shift.y, 0, 0, 1);
+    framePose = toFrame;
+    basePos = newBase;
+
+    // Only pairwise matching uses the warped frame as the next base. Borrow a buffer for it;
+    // its size varies a little with R, so round up to keep the number of pooled sizes down.
+    if (matchMode == MatchMode::PAIRWISE) {
+      lastMatchedImage = FramePool::shared().getImage(warp.bounds().size(), CV_8UC3, 64);
+      Mat dst = asMat(lastMatchedImage, ACCESS_WRITE);
+      warp.warp(dst, pos, Scalar::all(1));
+    }
   } else {
     lastMatchedImage = img1;
     LOG(ERROR) << "Transform matrix scale: " << s << endl;
@@ -239,24 +680,107 @@ IncrementalStitcher::Status IncrementalStitcher::composeImages(UMat img1, UMat i
   return Status::OK;
 }
 
-UMat IncrementalStitcher::composeImagesWithOffset(UMat img1, UMat img2, UMat img2mask,
-						  Point img_offset, Point coord_offset) {
-  vector<Point> corners;
-  corners.push_back(Point(0,0));
-  corners.push_back(img_offset-coord_offset);
-  
-  vector<Size> sizes;
-  sizes.push_back(img1.size());
-  sizes.push_back(img2.size());
+void IncrementalStitcher::setKeyframes(bool enable) {
+  useKeyframes = enable;
+}
+
+bool IncrementalStitcher::framePoseFor(const Mat& R, Matx33f& pose) {
+  Mat S = R.clone();
+  if (matchScale != 1.0) {
+    S.at<float>(0,2) /= matchScale;
+    S.at<float>(1,2) /= matchScale;
+  }
+  float s = scale(S);
+  if (s == 0) {
+    return false;
+  }
+  undoScale(S, s);
+  Point base = matchMode == MatchMode::PAIRWISE ? basePos : canvas.bounds().tl();
+  pose = Matx33f(S) * Matx33f(1, 0, -base.x, 0, 1, -base.y, 0, 0, 1);
+  return true;
+}
 
-  Rect bounds = detail::resultRoi(corners, sizes);
-  UMat buff = UMat::ones(bounds.height, bounds.width, CV_8UC3 );
-  Rect r1(img_offset.x, img_offset.y, img2.cols, img2.rows);
-  Rect r2(coord_offset.x, coord_offset.y, img1.cols, img1.rows);
-  img1.copyTo(buff(r2));           // Place base image with no mask.
-  img2.copyTo(buff(r1), img2mask); // Place second image, masked.
+IncrementalStitcher::Status IncrementalStitcher::stitchFrame(Image& base, Image img,
+							     Size imageSize,
+							     FrameResult& result) {
+  result = FrameResult();
+  Mat R;
+  double t = getTime();
+  Status status = detectAndMatch(base, img, R);
+  result.matchTime = getTime() - t;
+  if (status == Status::OK) {
+    status = checkTransform(R, imageSize);
+  }
+  if (status != Status::OK) {
+    return status;
+  }
 
-  return buff;
+  // Frames that add nothing to the map only update the motion model.
+  if (!isKeyframe(img, R)) {
+    result.matched = framePoseFor(R, result.pose);
+    return Status::OK;
+  }
+  t = getTime();
+  status = composeImages(base, img, R);
+  result.composeTime = getTime() - t;
+  if (status != Status::OK) {
+    return status;
+  }
+  result.matched = true;
+  result.composed = true;
+  result.pose = getFramePose();
+  getNextBaseImage().copyTo(base);
+  return Status::OK;
+}
+
+bool IncrementalStitcher::isKeyframe(Image img2, const Mat& R) {
+  Matx33f toFrame;
+  if (!useKeyframes || canvas.empty() || !framePoseFor(R, toFrame)) {
+    return true; // composeImages handles the first frame and reports a bad R.
+  }
+
+  // Sharpness at quarter resolution, which is plenty to tell a blurred frame.
+  FramePool& pool = FramePool::shared();
+  Size size(img2.cols/4, img2.rows/4);
+  Mat small = pool.getMat(size, img2.type());
+  Mat gray = pool.getMat(size, CV_8U);
+  resize(img2, small, size, 0, 0, INTER_AREA);
+  cvtColor(small, gray, CV_BGR2GRAY);
+  double sharp = sharpness(gray);
+  meanSharpness = meanSharpness == 0 ? sharp : 0.9*meanSharpness + 0.1*sharp;
+
+  // Motion of the frame center since the last keyframe.
+  Matx33f M = toFrame * framePose.inv();
+  Point3f c(img2.cols/2.0f, img2.rows/2.0f, 1.0f);
+  Point3f m = M * c;
+  double shift = norm(Point2f(m.x - c.x, m.y - c.y));
+  double rotation = std::abs(getAngle(M));
+
+  Mat src = asMat(img2);
+  AffineWarp warp(src, toFrame.get_minor<2, 3>(0, 0), true);
+  double newArea = 1.0 - canvas.coverage(warp);
+
+  bool moved = newArea >= minNewArea || shift >= minKeyframeShift ||
+    rotation >= minKeyframeRotation;
+  bool keyframe = (moved && sharp >= minKeyframeSharpness * meanSharpness) ||
+    shift >= maxKeyframeShift;
+  LOG(INFO) << "Keyframe: " << keyframe << "  new area: " << newArea << "  shift: " << shift
+	    << "  rotation: " << rotation << "  sharpness: " << sharp << "/" << meanSharpness
+	    << endl;
+  return keyframe;
+}
+
+IncrementalStitcher::Status IncrementalStitcher::checkTransform(Mat R, Size imageSize) {
+  Status status = Status::OK;
+  if (abs(R.at<float>(0,2)) > imageSize.width/3) {
+    status = Status::EXCEEDS_X_THRESHOLD_ERR;
+  } else if (abs(R.at<float>(1,2)) > imageSize.height/3) {
+    status = Status::EXCEEDS_X_THRESHOLD_ERR;
+  } else if (abs(angle(R)) > 15.0) {
+    status = Status::EXCEEDS_X_THRESHOLD_ERR;
+  }
+
+  return status;
 }
 
 string IncrementalStitcher::getError(IncrementalStitcher::Status status) {
@@ -286,6 +810,9 @@ string IncrementalStitcher::getError(IncrementalStitcher::Status status) {
   case IncrementalStitcher::Status::ESTIMATION_ERR:
     error = "Camera estimation error.";
     break;
+  case IncrementalStitcher::Status::REFINE_ERR:
+    error = "Refinement didn't converge.";
+    break;
   }
   return error;
 }
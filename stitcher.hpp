@@ -3,12 +3,38 @@
 #include <opencv2/xfeatures2d.hpp>
 #include <math.h>
 #include "util.hpp"
+#include "canvas.hpp"
+#include "profile.hpp"
+#include "framepool.hpp"
 
 #ifndef INCREMENTAL_STITCHER
 #define INCREMENTAL_STITCHER
 
 using namespace cv;
 
+class Config;
+
+/** Uniform grid index over keypoint locations, for spatial window queries. */
+class KeyPointGrid {
+  public:
+    KeyPointGrid(const vector<KeyPoint>& keypoints, Size size, int cellSize);
+
+    /** Collect indices of keypoints in cells overlapping the window around pt. */
+    void query(Point2f pt, float radius, vector<int>& indices) const;
+
+  private:
+    int cellSize;
+
+    int cols;
+
+    int rows;
+
+    /** Keypoint indices bucketed by cell; cell i spans [cellStart[i], cellStart[i+1]). */
+    vector<int> cellStart;
+
+    vector<int> cellIndices;
+};
+
 class CV_EXPORTS_W IncrementalStitcher {
   public:
     enum Status {
@@ -20,6 +46,7 @@ class CV_EXPORTS_W IncrementalStitcher {
       EXCEEDS_Y_THRESHOLD_ERR = 104,
       EXCEEDS_R_THRESHOLD_ERR = 105,
       ESTIMATION_ERR = 200,
+      REFINE_ERR = 201,
       COMPOSE_ERR = 300,
       COMPOSE_ERR_SCALE_IS_ZERO = 301,
     };
@@ -46,43 +73,186 @@ class CV_EXPORTS_W IncrementalStitcher {
 			DetectMethod detectMethod=DetectMethod::DETECT_SURF,
 			ExtractMethod extractMethod=ExtractMethod::EXTRACT_FREAK);
 
+    /** Stitcher with config's match_scale, detect_method and extract_method. Unknown
+	method names are logged and left at their defaults. */
+    IncrementalStitcher(const Config& config, MatchMode matchMode);
+
+    /** Method named "surf", "orb" or "sift". False if name isn't one of them. */
+    static bool parseDetectMethod(const string& name, DetectMethod& method);
+
+    /** Method named "surf", "orb", "freak" or "brisk". */
+    static bool parseExtractMethod(const string& name, ExtractMethod& method);
+
+    static const char* detectMethodName(DetectMethod method);
+
+    static const char* extractMethodName(ExtractMethod method);
+
     /** Detect and matches features on 2 images. */
-    Status detectAndMatch(UMat img1, UMat img2, Mat& R);
+    Status detectAndMatch(Image img1, Image img2, Mat& R);
+
+    /** Match img2 against precomputed base features, e.g. loaded from a map bundle. */
+    Status detectAndMatch(const detail::ImageFeatures& f0, Image img2, Mat& R);
+
+    /** Match frame features from detectFeatures against base features f0, without the
+	motion prior and without updating it, e.g. to verify a relocalization candidate. Safe
+	to call from several threads at once. confidence: the match's inlier confidence. */
+    Status verifyMatch(const detail::ImageFeatures& f0, const detail::ImageFeatures& f1,
+		       Mat& R, double* confidence=NULL) const;
+
+    /**
+     * Refine R, a full-resolution transform from base to img such as a feature match gives,
+     * by aligning the images' intensities directly (ECC), coarse to fine over a few pyramid
+     * levels. Only img's non-black pixels are used. The result has no scale. error: the
+     * standard error of the refined translation, in pixels, estimated from the residual
+     * and base's gradients, and at least refineErrorFloor.
+     */
+    Status refine(Image base, Image img, Mat& R, double& error) const;
+
+    /** Detect and describe features at match scale, as detectAndMatch does for its base.
+	The detector's threshold stays at its initial value. */
+    void detectFeatures(Image img, detail::ImageFeatures& features);
+
+    /** Keep the strongest cap keypoints in each cellSize square, so they spread over the
+	image rather than bunching in its most textured parts. */
+    static void bucketKeypoints(vector<KeyPoint>& keypoints, int cellSize, int cap);
+
+    /** Where features may be detected in gray: non-black pixels, eroded so the edges of
+	the projected image aren't detected as features. */
+    static void featureMask(const Mat& gray, Mat& mask);
+
+    float getMatchScale();
+
+    DetectMethod getDetectMethod();
+
+    ExtractMethod getExtractMethod();
 
     /** Warp and compose 2 images based on the transform. */
-    Status composeImages(UMat img1, UMat img2, Mat& R);
+    Status composeImages(Image img1, Image img2, Mat& R);
+
+    /** Dense copy of the stitched image. Expensive on large canvases; use for saving. */
+    Image getStitchedImage();
+
+    /** Accessor for the tiled stitched canvas. */
+    Canvas& getCanvas();
+
+    /** Stitch into canvas, e.g. one backed by a mapped tile store. Call before composing. */
+    void setCanvas(const Canvas& canvas);
+
+    /** Transform from canvas coordinates to the last composed frame, at full resolution
+	with scale removed. Composing the frame with this transform reproduces the stitch. */
+    Matx33f getFramePose();
 
-    /** Accessor for stiched image. */
-    UMat getStitchedImage();
+    /** Transform from canvas coordinates to a frame matched with R, at full resolution with
+	scale removed, as composeImages would compose it. False if R has no scale. */
+    bool framePoseFor(const Mat& R, Matx33f& pose);
+
+    /** Tag this stitcher's timings with frame, from Source::getFrameId(), whichever thread
+	runs it. */
+    void setFrameId(int64_t frame);
+
+    /** Capture time of the frame about to be matched, from Source::getFrameTime(), for the
+	motion model. Until it's set, frames are timed when they're matched. */
+    void setFrameTime(double t);
 
     /** Get next matching base image for current mode. */
-    UMat getNextBaseImage();
+    Image getNextBaseImage();
+
+    /** Enable or disable motion-prior guided matching. */
+    void setMotionPrior(bool enable);
+
+    /** Forget the motion model, e.g. when the caller switches to a different base image. */
+    void resetMotion();
+
+    /**
+     * Whether a frame matched with R, from detectAndMatch, is worth composing. It must add
+     * at least minNewArea of uncovered canvas or have moved or turned enough since the last
+     * composed frame, and mustn't be much blurrier than recent frames. A frame that has
+     * moved so far that the next ones might not match the base is composed regardless.
+     * Skip composeImages for other frames; matching has already updated the motion model.
+     */
+    bool isKeyframe(Image img2, const Mat& R);
+
+    /** Enable or disable keyframe selection. When disabled, every frame is a keyframe. */
+    void setKeyframes(bool enable);
+
+    /** Reject R if it moves more than a third of a camera frame of imageSize, or turns
+	more than 15 degrees. */
+    Status checkTransform(Mat R, Size imageSize);
+
+    /** What stitchFrame did with a frame. */
+    struct FrameResult {
+      /** Whether the frame matched and its transform passed checkTransform. */
+      bool matched = false;
+
+      /** Whether it was composed as a keyframe. */
+      bool composed = false;
+
+      /** Canvas to frame, as getFramePose, if it matched. */
+      Matx33f pose = Matx33f::zeros();
+
+      /** Seconds spent matching and composing. */
+      double matchTime = 0;
+
+      double composeTime = 0;
+    };
+
+    /**
+     * Stitch one frame the way stitch_stream does: match img against base, check the
+     * transform against a camera frame of imageSize, and compose it if it's a keyframe.
+     * Once a frame is composed, base becomes the base for the next one. Returns the first
+     * error, or OK for frames that matched but weren't keyframes.
+     */
+    Status stitchFrame(Image& base, Image img, Size imageSize, FrameResult& result);
 
     string getError(Status status);
 
   protected:
     Status matchImages(InputArrayOfArrays images, bool showMatches=false);
 
-    /** Compose 2 images with image and coord system offsets. */
-    UMat composeImagesWithOffset(UMat img1, UMat img2, UMat img2mask,
-				 Point image_offset, Point coord_offset);
+    /** Match two feature sets and validate the resulting transform. */
+    Status matchFeatures(const detail::ImageFeatures& f0, const detail::ImageFeatures& f1);
+
+    /** Match as matchFeatures does into info, guided by prior if it isn't NULL, without
+	touching the stitcher's state. */
+    Status matchPair(const detail::ImageFeatures& f0, const detail::ImageFeatures& f1,
+		     const Matx33f* prior, detail::MatchesInfo& info) const;
 
-    /** Accumlate translations to zero position within coordinate system and to coordinate
-	system itself. */
-    void translate(float x, float y);
+    /** Detect and describe features at match scale with detector. */
+    void detectFeatures(Image img, detail::ImageFeatures& features, Ptr<Feature2D> detector);
+
+    /** Move frameDetector's threshold toward detecting targetKeypoints per frame, given the
+	number a frame just detected. */
+    void adaptThreshold(int detected);
+
+    /** Predict the transform from the base image to a frame captured at time t, using a
+	constant-velocity model. Returns false if there is no usable motion history. */
+    bool predict(double t, Matx33f& R);
+
+    /** Record a matched transform (base to frame, full resolution) captured at time t. */
+    void updateMotion(const Matx33f& R, double t);
+
+    /** Match descriptors only within a window around each keypoint's predicted location
+	and estimate the transform from those candidates. */
+    void guidedMatch(const detail::ImageFeatures& f0, const detail::ImageFeatures& f1,
+		     const Matx33f& prior, detail::MatchesInfo& info) const;
 
   private:
+    /** Detector for base images and the canvas, at the initial threshold. */
     Ptr<Feature2D> detector;
 
+    /** Detector for frames, whose threshold adapts to them. Base images can be the whole
+	canvas, with different content, so they don't share it. */
+    Ptr<Feature2D> frameDetector;
+
     Ptr<DescriptorExtractor> extractor;
 
     float matchScale;
 
     /** The aggregate stitched image. */
-    UMat stitchedImage;
+    Canvas canvas;
 
     /** The last image matched, post-warp. */
-    UMat lastMatchedImage;
+    Image lastMatchedImage;
 
     /** Indicates pairwise vs. aggregate matching mode. In pairwise mode, we match the next
 	input image to the previous input image (post-rotation). In aggregate mode, we match
@@ -94,10 +264,24 @@ class CV_EXPORTS_W IncrementalStitcher {
     
     ExtractMethod extractMethod;
     
-    std::vector<cv::detail::ImageFeatures> features_;
-
     cv::detail::MatchesInfo matches_;
 
+    /** Pyramid levels refine() aligns at, coarsest first. Level 1 is half resolution, which
+	is still well under a pixel at full resolution and a quarter of the work. */
+    int refineCoarsestLevel = 2;
+
+    int refineFinestLevel = 1;
+
+    /** Iterations per level and the smallest parameter update that continues. */
+    int refineIterations = 15;
+
+    double refineEpsilon = 1e-3;
+
+    /** Least error refine() reports, in full resolution pixels. The residual estimate treats
+	every pixel's noise as independent, which camera noise, blur and lighting aren't, so
+	it comes out far below how well ECC actually repeats from frame to frame. */
+    double refineErrorFloor = 0.25;
+
     /** Maximum +/- scale permitted in "good" affine matrix. Note that scale is removed
      * before compoisition. */
     float matchScaleThreshold = 0.01;
@@ -105,16 +289,100 @@ class CV_EXPORTS_W IncrementalStitcher {
     /** Max detected points when using ORB matcher. */
     int maxDetectPoints = 1500;
 
-    /** Min Hessian threshold when using SURF matcher. */
+    /** Initial Hessian threshold when using SURF matcher. */
     int minHessian = 400;
 
-    /** Represent zero point in coordinate system. */
-    float dx = 0.0;
-    float dy = 0.0;
-    
-    /** Represent changes to coordinate system. */
-    float gx = 0.0;
-    float gy = 0.0;
+    /** Keypoints to keep per frame, at match scale. The SURF and ORB thresholds adapt
+	toward detecting detectMargin times this, and bucketing trims the rest. */
+    int targetKeypoints = 1000;
+
+    float detectMargin = 1.5;
+
+    /** Damping of threshold changes; 1 moves all the way to the estimate each frame. */
+    float adaptGain = 0.5;
+
+    /** The threshold only moves when the count is off by more than this fraction. */
+    float adaptDeadband = 0.2;
+
+    /** Side of a keypoint bucket, in pixels at match scale. */
+    int bucketSize = 64;
+
+    double hessianThreshold;
+
+    int fastThreshold = 20;
+
+    /** Typed handles on frameDetector, for whichever adapts. */
+    Ptr<xfeatures2d::SURF> surfDetector;
+
+    Ptr<ORB> orbDetector;
+
+    /** Keypoints found by the last detection, before bucketing. */
+    int detectedKeypoints = 0;
+
+    /** Area of the frame being matched, at match scale; 0 before the first frame. */
+    double frameArea = 0;
+
+    /** Use the motion model to restrict candidate matches. */
+    bool useMotionPrior = true;
+
+    /** Transform from the current base image to the last matched frame. */
+    Matx33f lastPose;
+
+    /** Frame-to-frame motion between the last two matched frames. */
+    Matx33f lastMotion;
+
+    double lastPoseTime = 0.0;
+
+    double lastMotionDt = 0.0;
+
+    bool hasPose = false;
+
+    bool hasMotion = false;
+
+    /** Prediction for the frame currently being matched, at match scale. */
+    Matx33f prediction;
+
+    bool hasPrediction = false;
+
+    /** Don't extrapolate from poses older than this (seconds). */
+    double maxPredictAge = 1.0;
+
+    /** Search radius around predicted keypoint locations, in pixels at match scale. */
+    float priorRadius = 40.0;
+
+    /** Min inliers from guided matching before falling back to exhaustive matching. */
+    int minPriorInliers = 20;
+
+    Matx33f framePose = Matx33f::eye();
+
+    bool useKeyframes = true;
+
+    /** Min fraction of a keyframe not yet on the canvas. */
+    float minNewArea = 0.05;
+
+    /** Min movement of the frame center since the last keyframe, in pixels. */
+    float minKeyframeShift = 64.0;
+
+    /** Min rotation since the last keyframe, in degrees. */
+    float minKeyframeRotation = 2.0;
+
+    /** Movement since the last keyframe past which a frame is composed even if blurry, in
+	pixels. Well inside checkTransform's limit, so the base never falls out of reach. */
+    float maxKeyframeShift = 160.0;
+
+    /** Min sharpness of a keyframe, relative to the moving average of recent frames. */
+    float minKeyframeSharpness = 0.7;
+
+    double meanSharpness = 0.0;
+
+    /** Canvas position of the top-left of the current base image. */
+    Point basePos = Point(0, 0);
+
+    /** Frame being matched or composed, for tracing. */
+    int64_t frameId = 0;
+
+    /** Capture time of the frame being matched; negative if unknown. */
+    double frameTime = -1;
   };
  
 #endif
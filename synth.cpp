@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "util.hpp"
+#include "config.hpp"
+#include "scene.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Render a synthetic scan of the markerboard over a work surface, with ground truth:
+//
+//   handicam_synth <dir> [frames] [seed]
+//
+// Writes frame_NNNN.png for each frame, surface.png, and truth.yml with each frame's board
+// corners, board pose and surface-to-frame transform. The frames can be fed to
+// stitch_stream and match_stream like any other image files.
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    LOG(ERROR) << "Usage: " << argv[0] << " <dir> [frames] [seed]" << endl;
+    return -1;
+  }
+  string dir = argv[1];
+  int frames = argc > 2 ? atoi(argv[2]) : 60;
+
+  Config config;
+  SceneOptions options;
+  if (argc > 3) {
+    options.seed = atoi(argv[3]);
+  }
+  SceneGenerator generator(config, options);
+
+  mkdir(dir.c_str(), 0755);
+  if (!imwrite(dir + "/surface.png", generator.getSurface())) {
+    LOG(ERROR) << "Failed to write to " << dir << endl;
+    return -1;
+  }
+
+  FileStorage fs(dir + "/truth.yml", FileStorage::WRITE);
+  fs << "pixels_per_inch" << generator.getPixelsPerInch();
+  fs << "frames" << "[";
+  for (int i=0; i<frames; i++) {
+    SceneFrame f = generator.next();
+    char name[32];
+    snprintf(name, sizeof(name), "frame_%04d.png", i);
+    imwrite(dir + "/" + name, f.img);
+    fs << "{:" << "file" << name << "x" << f.x << "y" << f.y << "angle" << f.angle
+       << "corners" << vector<Point2f>(f.corners, f.corners + 4)
+       << "surface_to_frame" << Mat(f.surfaceToFrame) << "}";
+  }
+  fs << "]";
+  fs.release();
+  LOG(INFO) << "Wrote " << frames << " frames to " << dir << endl;
+  return 0;
+}
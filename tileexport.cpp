@@ -0,0 +1,126 @@
+#include "tileexport.hpp"
+#include <sys/stat.h>
+
+using namespace std;
+using namespace cv;
+
+// Encode and write a batch of tiles, one file per tile.
+class WriteTiles: public ParallelLoopBody {
+  public:
+    WriteTiles(const vector<Mat>& _tiles, const vector<string>& _files,
+	       const vector<int>& _params, std::atomic<int>& _failures)
+      : tiles(_tiles), files(_files), params(_params), failures(_failures) {}
+
+    virtual void operator()(const Range& range) const {
+      for (int i=range.start; i<range.end; i++) {
+	if (!imwrite(files[i], tiles[i], params)) {
+	  failures++;
+	}
+      }
+    }
+
+  private:
+    const vector<Mat>& tiles;
+    const vector<string>& files;
+    const vector<int>& params;
+    std::atomic<int>& failures;
+};
+
+TileExporter::TileExporter(const string& _dir, int _quality) {
+  dir = _dir;
+  quality = _quality;
+  finished = true;
+}
+
+TileExporter::~TileExporter() {
+  wait();
+}
+
+void TileExporter::start(Canvas& canvas) {
+  wait();
+  finished = false;
+  status = Status::OK;
+  worker = std::thread(&TileExporter::run, this, &canvas);
+}
+
+bool TileExporter::done() {
+  return finished;
+}
+
+TileExporter::Status TileExporter::wait() {
+  if (worker.joinable()) {
+    worker.join();
+  }
+  return status;
+}
+
+string TileExporter::getError(TileExporter::Status status) {
+  string error = "None";
+  switch(status) {
+  case TileExporter::Status::OPEN_ERR:
+    error = "Failed to create export directory.";
+    break;
+  case TileExporter::Status::WRITE_ERR:
+    error = "Failed to write some tiles.";
+    break;
+  }
+  return error;
+}
+
+void TileExporter::run(Canvas* canvas) {
+  double t = getTime();
+  vector<int> params;
+  params.push_back(IMWRITE_JPEG_QUALITY);
+  params.push_back(quality);
+  std::atomic<int> failures(0);
+
+  mkdir(dir.c_str(), 0755);
+  FileStorage fs(dir + "/index.tmp.yml", FileStorage::WRITE);
+  if (!fs.isOpened()) {
+    LOG(ERROR) << "Failed to open export index in " << dir << endl;
+    status = Status::OPEN_ERR;
+    finished = true;
+    return;
+  }
+  fs << "tile_size" << canvas->getTileSize();
+  fs << "levels" << canvas->getLevels() + 1;
+  fs << "bounds" << canvas->bounds();
+  fs << "tiles" << "[";
+
+  int count = 0;
+  for (int level=0; level<=canvas->getLevels(); level++) {
+    string levelDir = dir + "/" + to_string(level);
+    mkdir(levelDir.c_str(), 0755);
+
+    vector<Point> keys;
+    canvas->tiles(level, keys);
+    for (int start=0; start<keys.size(); start+=batchSize) {
+      // The tile store isn't thread-safe, so tiles are read here and only encoding runs
+      // in parallel.
+      int end = std::min(start + batchSize, (int)keys.size());
+      vector<Mat> tiles;
+      vector<string> files;
+      for (int i=start; i<end; i++) {
+	tiles.push_back(canvas->readTile(keys[i], level));
+	files.push_back(levelDir + "/" + to_string(keys[i].x) + "_" + to_string(keys[i].y) +
+			".jpg");
+	fs << "[:" << level << keys[i].x << keys[i].y << "]";
+      }
+      parallel_for_(Range(0, tiles.size()), WriteTiles(tiles, files, params, failures));
+      count += tiles.size();
+    }
+  }
+  fs << "]";
+  fs.release();
+
+  // The index goes in last, so readers never see a partial export.
+  rename((dir + "/index.tmp.yml").c_str(), (dir + "/index.yml").c_str());
+
+  if (failures > 0) {
+    LOG(ERROR) << failures << " tiles failed to write." << endl;
+    status = Status::WRITE_ERR;
+  }
+  LOG(INFO) << "Exported " << count << " tiles to " << dir << " in " << getTime() - t
+	    << "s" << endl;
+  finished = true;
+}
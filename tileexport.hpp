@@ -0,0 +1,61 @@
+#include <opencv2/opencv.hpp>
+#include <thread>
+#include <atomic>
+#include "util.hpp"
+#include "canvas.hpp"
+
+#ifndef TILE_EXPORT
+#define TILE_EXPORT
+
+using namespace cv;
+using namespace std;
+
+/**
+ * Writes a canvas as a tiled, pyramidal image: <dir>/<level>/<x>_<y>.jpg for every stored
+ * tile of every pyramid level, plus <dir>/index.yml with the tile size, level count, bounds
+ * and tile list. A viewer can load only the tiles and level it needs.
+ *
+ * The export runs on a background thread, and tiles are encoded in parallel.
+ */
+class TileExporter {
+  public:
+    enum Status {
+      OK = 0,
+      OPEN_ERR = 100,
+      WRITE_ERR = 101,
+    };
+
+    TileExporter(const string& dir, int quality=90);
+
+    /** Waits for a running export. */
+    ~TileExporter();
+
+    /** Start exporting canvas. Don't use the canvas until the export is done. */
+    void start(Canvas& canvas);
+
+    /** True once the export has finished, or if none was started. */
+    bool done();
+
+    /** Block until the export finishes. */
+    Status wait();
+
+    string getError(Status status);
+
+  private:
+    void run(Canvas* canvas);
+
+    string dir;
+
+    int quality;
+
+    /** Tiles read per batch. Tiles are read serially, then encoded in parallel. */
+    int batchSize = 64;
+
+    std::thread worker;
+
+    std::atomic<bool> finished;
+
+    Status status = OK;
+};
+
+#endif
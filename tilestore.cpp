@@ -0,0 +1,225 @@
+#include "tilestore.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+using namespace std;
+using namespace cv;
+
+static const char TILES_MAGIC[8] = "HCTILES";
+static const int TILES_VERSION = 2;
+
+// Slot offsets pass 2 GB on large maps. CMakeLists.txt sets _FILE_OFFSET_BITS=64.
+static_assert(sizeof(off_t) == 8, "tile store needs 64-bit file offsets");
+
+MemoryTileStore::MemoryTileStore(int _tileSize, int _type) {
+  tileSize = _tileSize;
+  type = _type;
+}
+
+Mat MemoryTileStore::get(TileKey key, bool create) {
+  std::map<TileKey, Mat>::iterator it = tiles.find(key);
+  if (it != tiles.end()) {
+    return it->second;
+  }
+  if (!create) {
+    return Mat();
+  }
+  Mat tile = Mat::zeros(tileSize, tileSize, type);
+  tiles[key] = tile;
+  return tile;
+}
+
+void MemoryTileStore::keys(vector<TileKey>& out) {
+  out.clear();
+  for (std::map<TileKey, Mat>::iterator it=tiles.begin(); it!=tiles.end(); it++) {
+    out.push_back(it->first);
+  }
+}
+
+Rect MemoryTileStore::getBounds() {
+  return bounds;
+}
+
+void MemoryTileStore::setBounds(Rect r) {
+  bounds = r;
+}
+
+int MemoryTileStore::getTileSize() {
+  return tileSize;
+}
+
+int MemoryTileStore::getType() {
+  return type;
+}
+
+MappedTileStore::MappedTileStore(const string& dir, size_t _memoryCap, int tileSize,
+				 int type, bool truncate, const string& name) {
+  memoryCap = _memoryCap;
+  pageSize = sysconf(_SC_PAGESIZE);
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TILES_MAGIC, sizeof(header.magic));
+  header.version = TILES_VERSION;
+  header.tileSize = tileSize;
+  header.type = type;
+  mkdir(dir.c_str(), 0755);
+
+  string binFile = dir + "/" + name + ".bin";
+  string idxFile = dir + "/" + name + ".idx";
+  int flags = O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0);
+  fd = open(binFile.c_str(), flags, 0644);
+  idx = fopen(idxFile.c_str(), truncate ? "w+b" : "a+b");
+  if (fd < 0 || idx == NULL) {
+    LOG(ERROR) << "Failed to open tile store: " << dir << endl;
+    status = Status::OPEN_ERR;
+    return;
+  }
+
+  struct stat st;
+  fstat(fd, &st);
+  if (st.st_size == 0) {
+    writeHeader(); // New store.
+  } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	     memcmp(header.magic, TILES_MAGIC, sizeof(header.magic)) != 0 ||
+	     header.version != TILES_VERSION) {
+    LOG(ERROR) << "Bad tile store header: " << binFile << endl;
+    status = Status::FORMAT_ERR;
+    return;
+  }
+
+  size_t tileBytes = (size_t)header.tileSize * header.tileSize * CV_ELEM_SIZE(header.type);
+  slotBytes = (tileBytes + pageSize - 1) / pageSize * pageSize;
+
+  // Rebuild the slot table from the index.
+  TileKey key;
+  int64_t slot = 0;
+  fseek(idx, 0, SEEK_SET);
+  while (fread(&key, sizeof(key), 1, idx) == 1) {
+    slots[key] = slot++;
+  }
+  LOG(INFO) << "Opened tile store " << dir << " with " << slots.size() << " tiles." << endl;
+}
+
+MappedTileStore::~MappedTileStore() {
+  while (!hot.empty()) {
+    evict();
+  }
+  if (fd >= 0) {
+    if (status == Status::OK) {
+      writeHeader();
+    }
+    close(fd);
+  }
+  if (idx != NULL) {
+    fclose(idx);
+  }
+}
+
+MappedTileStore::Status MappedTileStore::getStatus() {
+  return status;
+}
+
+void MappedTileStore::writeHeader() {
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    LOG(ERROR) << "Failed to write tile store header." << endl;
+  }
+}
+
+void MappedTileStore::evict() {
+  TileKey key = lru.back();
+  lru.pop_back();
+  std::map<TileKey, HotTile>::iterator it = hot.find(key);
+  munmap(it->second.addr, slotBytes);
+  hot.erase(it);
+}
+
+void MappedTileStore::setMemoryCap(size_t _memoryCap) {
+  memoryCap = _memoryCap;
+  while (!hot.empty() && hot.size() * slotBytes > memoryCap) {
+    evict();
+  }
+}
+
+void MappedTileStore::flush() {
+  for (std::map<TileKey, HotTile>::iterator it=hot.begin(); it!=hot.end(); it++) {
+    msync(it->second.addr, slotBytes, MS_SYNC);
+  }
+  writeHeader();
+  fflush(idx);
+}
+
+Mat MappedTileStore::get(TileKey key, bool create) {
+  if (status != Status::OK) {
+    return Mat();
+  }
+
+  std::map<TileKey, HotTile>::iterator it = hot.find(key);
+  if (it != hot.end()) {
+    lru.splice(lru.begin(), lru, it->second.lru);
+    return Mat(header.tileSize, header.tileSize, header.type, it->second.addr);
+  }
+
+  std::map<TileKey, int64_t>::iterator sit = slots.find(key);
+  int64_t slot;
+  if (sit != slots.end()) {
+    slot = sit->second;
+  } else if (create) {
+    // Append a slot. Growing the file leaves a zero-filled hole, so the tile starts black
+    // without writing it.
+    slot = slots.size();
+    if (ftruncate(fd, pageSize + (off_t)(slot+1) * slotBytes) != 0) {
+      LOG(ERROR) << "Failed to grow tile store." << endl;
+      return Mat();
+    }
+    fwrite(&key, sizeof(key), 1, idx);
+    fflush(idx);
+    slots[key] = slot;
+  } else {
+    return Mat();
+  }
+
+  // Make room in the working set. Keep at least the tile being returned.
+  while (!hot.empty() && (hot.size() + 1) * slotBytes > memoryCap) {
+    evict();
+  }
+
+  void* addr = mmap(NULL, slotBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		    pageSize + (off_t)slot * slotBytes);
+  if (addr == MAP_FAILED) {
+    LOG(ERROR) << "Failed to map tile " << key.x << ", " << key.y << " @" << key.level << endl;
+    return Mat();
+  }
+  lru.push_front(key);
+  HotTile h = {addr, lru.begin()};
+  hot[key] = h;
+  return Mat(header.tileSize, header.tileSize, header.type, addr);
+}
+
+void MappedTileStore::keys(vector<TileKey>& out) {
+  out.clear();
+  for (std::map<TileKey, int64_t>::iterator it=slots.begin(); it!=slots.end(); it++) {
+    out.push_back(it->first);
+  }
+}
+
+Rect MappedTileStore::getBounds() {
+  return Rect(header.x, header.y, header.width, header.height);
+}
+
+void MappedTileStore::setBounds(Rect r) {
+  header.x = r.x;
+  header.y = r.y;
+  header.width = r.width;
+  header.height = r.height;
+  writeHeader();
+}
+
+int MappedTileStore::getTileSize() {
+  return header.tileSize;
+}
+
+int MappedTileStore::getType() {
+  return header.type;
+}
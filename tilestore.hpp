@@ -0,0 +1,154 @@
+#include <opencv2/opencv.hpp>
+#include <map>
+#include <list>
+#include <stdint.h>
+#include "util.hpp"
+
+#ifndef TILE_STORE
+#define TILE_STORE
+
+using namespace cv;
+using namespace std;
+
+/**
+ * Signed tile coordinates. Tile (x, y) covers pixels [x*size, (x+1)*size) of pyramid level
+ * level, where level 0 is full resolution.
+ */
+struct TileKey {
+  int x;
+  int y;
+  int level;
+
+  bool operator<(const TileKey& o) const {
+    if (level != o.level) return level < o.level;
+    return y < o.y || (y == o.y && x < o.x);
+  }
+};
+
+/** Backing storage for Canvas tiles. */
+class TileStore {
+  public:
+    virtual ~TileStore() {}
+
+    /**
+     * Tile for key, optionally allocating a zeroed tile. Returns an empty Mat if the tile
+     * is missing. The returned Mat is only guaranteed valid until the next call to get().
+     */
+    virtual Mat get(TileKey key, bool create) = 0;
+
+    /** Keys of all stored tiles. */
+    virtual void keys(vector<TileKey>& out) = 0;
+
+    /** Persisted canvas bounds. */
+    virtual Rect getBounds() = 0;
+
+    virtual void setBounds(Rect r) = 0;
+
+    virtual int getTileSize() = 0;
+
+    virtual int getType() = 0;
+
+    /** Persist any buffered writes. */
+    virtual void flush() {}
+};
+
+/** Tiles held in RAM. */
+class MemoryTileStore: public TileStore {
+  public:
+    MemoryTileStore(int tileSize=256, int type=CV_8UC3);
+    virtual Mat get(TileKey key, bool create);
+    virtual void keys(vector<TileKey>& out);
+    virtual Rect getBounds();
+    virtual void setBounds(Rect r);
+    virtual int getTileSize();
+    virtual int getType();
+
+  private:
+    int tileSize;
+    int type;
+    Rect bounds;
+    std::map<TileKey, Mat> tiles;
+};
+
+/**
+ * Tiles held in a memory-mapped file, with an LRU working set of mapped tiles capped at
+ * memoryCap bytes. Tiles outside the working set are unmapped and paged back in on demand.
+ *
+ * Layout of <dir>/<name>.bin: a one-page header, then one page-aligned slot per tile.
+ * <dir>/<name>.idx lists the key of each slot, in slot order, and is only appended to.
+ */
+class MappedTileStore: public TileStore {
+  public:
+    enum Status {
+      OK = 0,
+      OPEN_ERR = 100,
+      FORMAT_ERR = 101,
+    };
+
+    /**
+     * Open the store in dir, creating it if needed. truncate: discard existing tiles.
+     * tileSize and type are ignored when opening an existing store. name: base name of
+     * the store's files, so a directory can hold several stores.
+     */
+    MappedTileStore(const string& dir, size_t memoryCap, int tileSize=256,
+		    int type=CV_8UC3, bool truncate=false, const string& name="tiles");
+    virtual ~MappedTileStore();
+    virtual Mat get(TileKey key, bool create);
+    virtual void keys(vector<TileKey>& out);
+    virtual Rect getBounds();
+    virtual void setBounds(Rect r);
+    virtual int getTileSize();
+    virtual int getType();
+
+    /** Write back dirty pages and the header. */
+    virtual void flush();
+
+    /** Change the cap on mapped tiles, unmapping the least recently used to fit. */
+    void setMemoryCap(size_t memoryCap);
+
+    Status getStatus();
+
+  private:
+    struct Header {
+      char magic[8];
+      int version;
+      int tileSize;
+      int type;
+      int x;
+      int y;
+      int width;
+      int height;
+    };
+
+    struct HotTile {
+      void* addr;
+      std::list<TileKey>::iterator lru;
+    };
+
+    void writeHeader();
+
+    void evict();
+
+    Status status = OK;
+
+    int fd = -1;
+
+    FILE* idx = NULL;
+
+    Header header;
+
+    size_t pageSize;
+
+    size_t slotBytes;
+
+    size_t memoryCap;
+
+    std::map<TileKey, int64_t> slots;
+
+    /** Mapped tiles; most recently used at the front of lru. */
+    std::map<TileKey, HotTile> hot;
+
+    std::list<TileKey> lru;
+};
+
+#endif
@@ -26,13 +26,14 @@ UMat imscale(int width, UMat uimg) {
   return imscale(width, uimg.getMat(ACCESS_READ)).getUMat(ACCESS_READ);
 }
 
+// Monotonic, so intervals are immune to clock adjustments.
 double getTime(){
-  struct timeval time;
-  if (gettimeofday(&time,NULL)){
+  struct timespec time;
+  if (clock_gettime(CLOCK_MONOTONIC, &time)){
     //  Handle error
     return 0;
   }
-  return (double)time.tv_sec + (double)time.tv_usec * .000001;
+  return (double)time.tv_sec + (double)time.tv_nsec * .000000001;
 }
 
 void getCameraProfile(int W, Mat& cameraMatrix, Mat& distCoeffs) {
@@ -44,6 +45,13 @@ void getCameraProfile(int W, Mat& cameraMatrix, Mat& distCoeffs) {
   fs.release();
 }
 
+// Map r into a view whose top-left is at origin and scaled by scale.
+Rect viewRect(Rect r, Point origin, float scale) {
+  return Rect(Point(cvRound((r.x - origin.x) * scale), cvRound((r.y - origin.y) * scale)),
+	      Point(cvRound((r.br().x - origin.x) * scale),
+		    cvRound((r.br().y - origin.y) * scale)));
+}
+
 float getAngle(Matx33f H) {
   double t = atan(H(1,0) / H(0,0));
   double deg = t * (180/3.1415926535897);
@@ -57,7 +65,7 @@ float getScale(Matx33f H) {
   return s;
 }
 
-void drawText(UMat img, string text, int bottom) {
+Rect drawText(Image img, string text, int bottom) {
   int fontFace = FONT_HERSHEY_SIMPLEX;
   double fontScale = 0.5 * img.cols / 600; // compensate for rescaling for UI.
   int thickness = 2.0 * img.cols/800;
@@ -71,12 +79,16 @@ void drawText(UMat img, string text, int bottom) {
 		(img.rows - (textSize.height*bottom*2)-20));
   putText(img, text, textOrg, fontFace, fontScale,
 	  Scalar(255, 0, 0), thickness, 8);
+
+  // Area touched, including descenders and stroke width.
+  return Rect(textOrg.x - thickness, textOrg.y - textSize.height - thickness,
+	      textSize.width + thickness*2, textSize.height + baseline + thickness*2);
 }
 
-void drawGridText(UMat img, Rect r, string text, int bottom) {
+void drawGridText(Image img, Rect r, string text, int bottom, double scale) {
   int fontFace = FONT_HERSHEY_SIMPLEX;
-  double fontScale = 10.0; // compensate for rescaling for UI.
-  int thickness = 20.0;
+  double fontScale = 10.0 * scale; // compensate for rescaling for UI.
+  int thickness = std::max(1, cvRound(20.0 * scale));
 
   int baseline = 0;
   Size textSize = getTextSize(text, fontFace,
@@ -89,7 +101,7 @@ void drawGridText(UMat img, Rect r, string text, int bottom) {
 	  Scalar(255, 0, 0), thickness, 8);
 }
 
-void drawGridTextSmall(UMat img, Rect r, string text, int bottom, int mode) {
+void drawGridTextSmall(Image img, Rect r, string text, int bottom, int mode) {
   int fontFace = FONT_HERSHEY_SIMPLEX;
   double fontScale = 1.0 * (r.width/(double)600); // compensate for rescaling for UI.
   int thickness = 3.0 * (r.width/(double)600);
@@ -129,6 +141,16 @@ void getOffsets(float &gx, float &gy) {
   }
 }
 
+// Variance of the Laplacian, where mask is set. Higher is sharper, but it depends on
+// content, so only compare frames of similar scenes.
+double sharpness(const Mat& gray, const Mat& mask) {
+  Mat lap;
+  Laplacian(gray, lap, CV_16S);
+  Scalar mean, stddev;
+  meanStdDev(lap, mean, stddev, mask);
+  return stddev[0] * stddev[0];
+}
+
 double angle(Mat R) {
   double t = atan(R.at<float>(1,0) / R.at<float>(0,0));
   double deg = t * (180/3.1415926535897);
@@ -9,18 +9,45 @@
 using namespace std;
 using namespace cv;
 
+// The pipeline's image type. UMat lets OpenCV use OpenCL; CPU-only hosts can build with
+// HANDICAM_CPU_MAT to use Mat end to end and skip the UMat/Mat round trips.
+#ifdef HANDICAM_CPU_MAT
+typedef Mat Image;
+#else
+typedef UMat Image;
+#endif
+
+// View an Image as a Mat for APIs that take one, and back. No-ops with HANDICAM_CPU_MAT.
+inline Mat asMat(const Mat& img, int flags=ACCESS_READ) {
+  return img;
+}
+
+inline Mat asMat(const UMat& img, int flags=ACCESS_READ) {
+  return img.getMat(flags);
+}
+
+inline Image asImage(const Mat& img) {
+#ifdef HANDICAM_CPU_MAT
+  return img;
+#else
+  return img.getUMat(ACCESS_READ);
+#endif
+}
+
 Point2f intersect(Point2f a, Point2f b, Point2f c, Point2f d);
 Mat imscale(int width, Mat img);
 UMat imscale(int width, UMat img);
 void getCameraProfile(int W, Mat& cameraMatrix, Mat& distCoeffs);
 double getTime();
-void drawText(UMat img, string text, int bottom=0);
-void drawGridText(UMat img, Rect r, string text, int bottom=0);
-void drawGridTextSmall(UMat img, Rect r, string text, int bottom=0, int mode=0);
+Rect drawText(Image img, string text, int bottom=0);
+void drawGridText(Image img, Rect r, string text, int bottom=0, double scale=1.0);
+void drawGridTextSmall(Image img, Rect r, string text, int bottom=0, int mode=0);
 void saveOffsets(float gx, float gy);
 void getOffsets(float &gx, float &gy);
+Rect viewRect(Rect r, Point origin, float scale);
 float getAngle(Matx33f H);
 float getScale(Matx33f H);
 double angle(Mat R);
+double sharpness(const Mat& gray, const Mat& mask=Mat());
 
 #endif
@@ -0,0 +1,358 @@
+#include "warp.hpp"
+#include <opencv2/core/hal/intrin.hpp>
+#include <float.h>
+
+using namespace std;
+using namespace cv;
+
+// Source coordinates are computed with AB_BITS fractional bits and sampled at 1/2^INTER_BITS
+// pixel, as in cv::warpAffine.
+static const int AB_BITS = 10;
+static const int AB_SCALE = 1 << AB_BITS;
+static const int INTER_BITS = 5;
+static const int INTER_TAB_SIZE = 1 << INTER_BITS;
+static const int ROUND_DELTA = AB_SCALE / INTER_TAB_SIZE / 2;
+
+// Pixels of a row whose coordinates are computed at a time.
+static const int BLOCK = 256;
+
+// Rows per parallel band.
+static const int BAND_ROWS = 16;
+
+// Narrow [lo, hi] to the x where source coordinate a*x + c lies at least inset pixels inside
+// a source axis of size pixels. With no inset, that's where a nearest-neighbor mask warp
+// would be set.
+static bool clipSpan(double a, double c, int size, double inset, double& lo, double& hi) {
+  double u0 = -0.5 + inset, u1 = size - 0.5 - inset - 1e-4;
+  if (std::abs(a) < 1e-12) {
+    return c >= u0 && c <= u1;
+  }
+  double t0 = (u0 - c) / a;
+  double t1 = (u1 - c) / a;
+  if (t0 > t1) {
+    std::swap(t0, t1);
+  }
+  lo = std::max(lo, t0);
+  hi = std::min(hi, t1);
+  return lo <= hi;
+}
+
+// Set n pixels of cn channels to value.
+static void fillPixels(uchar* p, int n, const uchar* value, int cn) {
+  for (int i=0; i<n; i++) {
+    for (int c=0; c<cn; c++) {
+      *p++ = value[c];
+    }
+  }
+}
+
+// Bilinear blend of n pixels at the fixed-point source positions xs, ys with fractions fs.
+template<int cn>
+static void sampleRow(const Mat& src, const int* xs, const int* ys, const int* fs, int n,
+		      uchar* out) {
+  const int step = src.step[0];
+  for (int i=0; i<n; i++) {
+    int sx = xs[i], sy = ys[i];
+    int fx = fs[i] & (INTER_TAB_SIZE - 1), fy = fs[i] >> INTER_BITS;
+    // Replicate the edge; only pixels within half a pixel of it get here.
+    int dx = cn, dy = step;
+    if (sx < 0) {
+      sx = 0;
+      dx = 0;
+    } else if (sx >= src.cols - 1) {
+      sx = src.cols - 1;
+      dx = 0;
+    }
+    if (sy < 0) {
+      sy = 0;
+      dy = 0;
+    } else if (sy >= src.rows - 1) {
+      sy = src.rows - 1;
+      dy = 0;
+    }
+    const uchar* p = src.data + sy*step + sx*cn;
+    int w00 = (INTER_TAB_SIZE - fx) * (INTER_TAB_SIZE - fy);
+    int w01 = fx * (INTER_TAB_SIZE - fy);
+    int w10 = (INTER_TAB_SIZE - fx) * fy;
+    int w11 = fx * fy;
+    for (int c=0; c<cn; c++) {
+      out[c] = (uchar)((p[c]*w00 + p[c + dx]*w01 + p[c + dy]*w10 + p[c + dy + dx]*w11 +
+			(1 << (2*INTER_BITS - 1))) >> (2*INTER_BITS));
+    }
+    out += cn;
+  }
+}
+
+// Warp or compose a band of destination rows.
+class WarpRows: public ParallelLoopBody {
+  public:
+    WarpRows(AffineWarp* _warp, Mat& _dst, Mat& _stamps, Point _offset, const Scalar* _fill,
+	     AffineWarp::Policy _policy, ushort _stamp, int _band)
+      : warp(_warp), dst(_dst), stamps(_stamps), offset(_offset), fill(_fill != NULL),
+	policy(_policy), stamp(_stamp), band(_band) {
+      for (int c=0; c<4; c++) {
+	fillValue[c] = fill ? saturate_cast<uchar>((*_fill)[c]) : 0;
+      }
+    }
+
+    virtual void operator()(const Range& range) const {
+      int cn = dst.channels();
+      for (int row=range.start; row<range.end; row++) {
+	// Covered pixels [x0, x1) of the row, relative to dst.
+	int x0, x1;
+	bool covered = warp->span(offset.y + row, x0, x1);
+	if (covered) {
+	  x0 = std::max(x0 - offset.x, 0);
+	  x1 = std::min(x1 - offset.x, dst.cols);
+	  covered = x0 < x1;
+	}
+	if (!covered) {
+	  x0 = x1 = dst.cols;
+	}
+
+	uchar* out = dst.ptr(row);
+	if (fill) {
+	  fillPixels(out, x0, fillValue, cn);
+	  fillPixels(out + x1*cn, dst.cols - x1, fillValue, cn);
+	}
+	if (x0 == x1) {
+	  continue;
+	}
+	if (stamps.empty()) {
+	  warp->warpRow(offset.y + row, offset.x + x0, offset.x + x1, out + x0*cn);
+	} else {
+	  warp->composeRow(offset.y + row, offset.x + x0, offset.x + x1, out + x0*cn,
+			   stamps.ptr<ushort>(row) + x0, policy, stamp, band);
+	}
+      }
+    }
+
+  private:
+    AffineWarp* warp;
+    Mat& dst;
+    Mat& stamps;
+    Point offset;
+    bool fill;
+    uchar fillValue[4];
+    AffineWarp::Policy policy;
+    ushort stamp;
+    int band;
+};
+
+AffineWarp::AffineWarp(Mat _src, Matx23f transform, bool inverse) {
+  CV_Assert(_src.depth() == CV_8U &&
+	    (_src.channels() == 1 || _src.channels() == 3 || _src.channels() == 4));
+  src = _src;
+
+  Matx23d forward(transform(0,0), transform(0,1), transform(0,2),
+		  transform(1,0), transform(1,1), transform(1,2));
+  if (inverse) {
+    inv = forward;
+    invertAffineTransform(inv, forward);
+  } else {
+    invertAffineTransform(forward, inv);
+  }
+
+  // Pixel centers are at integer coordinates, so the image extends half a pixel past them.
+  Point2d corners[4] = {Point2d(-0.5, -0.5), Point2d(src.cols - 0.5, -0.5),
+			Point2d(src.cols - 0.5, src.rows - 0.5), Point2d(-0.5, src.rows - 0.5)};
+  double minX = DBL_MAX, minY = DBL_MAX, maxX = -DBL_MAX, maxY = -DBL_MAX;
+  for (int i=0; i<4; i++) {
+    double x = forward(0,0)*corners[i].x + forward(0,1)*corners[i].y + forward(0,2);
+    double y = forward(1,0)*corners[i].x + forward(1,1)*corners[i].y + forward(1,2);
+    minX = std::min(minX, x);
+    minY = std::min(minY, y);
+    maxX = std::max(maxX, x);
+    maxY = std::max(maxY, y);
+  }
+  area = Rect(Point(cvFloor(minX), cvFloor(minY)),
+	      Point(cvFloor(maxX) + 1, cvFloor(maxY) + 1));
+
+  adelta.resize(area.width);
+  bdelta.resize(area.width);
+  for (int i=0; i<area.width; i++) {
+    adelta[i] = saturate_cast<int>(inv(0,0)*(area.x + i)*AB_SCALE);
+    bdelta[i] = saturate_cast<int>(inv(1,0)*(area.x + i)*AB_SCALE);
+  }
+}
+
+bool AffineWarp::parsePolicy(const string& name, Policy& policy) {
+  if (name == "newest") {
+    policy = Policy::KEEP_NEWEST;
+  } else if (name == "fill") {
+    policy = Policy::FILL_UNCOVERED;
+  } else if (name == "seam") {
+    policy = Policy::SEAM_BLEND;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+Rect AffineWarp::bounds() {
+  return area;
+}
+
+bool AffineWarp::span(int y, int& x0, int& x1) {
+  return span(y, 0, x0, x1);
+}
+
+bool AffineWarp::span(int y, double inset, int& x0, int& x1) {
+  if (y < area.y || y >= area.y + area.height) {
+    return false;
+  }
+  double lo = area.x, hi = area.x + area.width - 1;
+  if (!clipSpan(inv(0,0), inv(0,1)*y + inv(0,2), src.cols, inset, lo, hi) ||
+      !clipSpan(inv(1,0), inv(1,1)*y + inv(1,2), src.rows, inset, lo, hi)) {
+    return false;
+  }
+  x0 = cvCeil(lo);
+  x1 = cvFloor(hi) + 1;
+  return x0 < x1;
+}
+
+bool AffineWarp::covers(Rect r) {
+  Rect isect = r & area;
+  for (int y=isect.y; y<isect.y + isect.height; y++) {
+    int x0, x1;
+    if (span(y, x0, x1) && x0 < isect.x + isect.width && x1 > isect.x) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void AffineWarp::warpRow(int y, int x0, int x1, uchar* out) {
+  int X0 = saturate_cast<int>((inv(0,1)*y + inv(0,2))*AB_SCALE) + ROUND_DELTA;
+  int Y0 = saturate_cast<int>((inv(1,1)*y + inv(1,2))*AB_SCALE) + ROUND_DELTA;
+  int cn = src.channels();
+
+  int xs[BLOCK], ys[BLOCK], fs[BLOCK];
+  for (int x=x0; x<x1; x+=BLOCK) {
+    int n = std::min(BLOCK, x1 - x);
+    const int* a = &adelta[x - area.x];
+    const int* b = &bdelta[x - area.x];
+
+    // Source position of each pixel in 1/INTER_TAB_SIZE pixels, split into the whole pixel
+    // and the fraction in each direction.
+    int i = 0;
+#if CV_SIMD128
+    v_int32x4 vX0 = v_setall_s32(X0), vY0 = v_setall_s32(Y0);
+    v_int32x4 vmask = v_setall_s32(INTER_TAB_SIZE - 1);
+    for (; i<=n - 4; i+=4) {
+      v_int32x4 X = v_shr<AB_BITS - INTER_BITS>(vX0 + v_load(a + i));
+      v_int32x4 Y = v_shr<AB_BITS - INTER_BITS>(vY0 + v_load(b + i));
+      v_store(xs + i, v_shr<INTER_BITS>(X));
+      v_store(ys + i, v_shr<INTER_BITS>(Y));
+      v_store(fs + i, v_shl<INTER_BITS>(Y & vmask) + (X & vmask));
+    }
+#endif
+    for (; i<n; i++) {
+      int X = (X0 + a[i]) >> (AB_BITS - INTER_BITS);
+      int Y = (Y0 + b[i]) >> (AB_BITS - INTER_BITS);
+      xs[i] = X >> INTER_BITS;
+      ys[i] = Y >> INTER_BITS;
+      fs[i] = ((Y & (INTER_TAB_SIZE - 1)) << INTER_BITS) + (X & (INTER_TAB_SIZE - 1));
+    }
+
+    uchar* o = out + (x - x0)*cn;
+    if (cn == 3) {
+      sampleRow<3>(src, xs, ys, fs, n, o);
+    } else if (cn == 1) {
+      sampleRow<1>(src, xs, ys, fs, n, o);
+    } else {
+      sampleRow<4>(src, xs, ys, fs, n, o);
+    }
+  }
+}
+
+void AffineWarp::composeRow(int y, int x0, int x1, uchar* out, ushort* stamps,
+			    Policy policy, ushort stamp, int band) {
+  int cn = src.channels();
+  if (policy == Policy::KEEP_NEWEST) {
+    warpRow(y, x0, x1, out);
+    std::fill(stamps, stamps + (x1 - x0), stamp);
+    return;
+  }
+
+  // In SEAM_BLEND, pixels further than band into the frame are overwritten, [i0, i1).
+  int i0 = x1, i1 = x1;
+  if (policy == Policy::SEAM_BLEND && span(y, band, i0, i1)) {
+    i0 = std::max(i0, x0);
+    i1 = std::min(i1, x1);
+  }
+  if (i0 >= i1) {
+    i0 = i1 = x1;
+  }
+
+  int x = x0;
+  while (x < x1) {
+    if (x == i0) {
+      warpRow(y, i0, i1, out + (i0 - x0)*cn);
+      std::fill(stamps + (i0 - x0), stamps + (i1 - x0), stamp);
+      x = i1;
+      continue;
+    }
+
+    // Runs of uncovered pixels are written outright; covered ones are left or blended.
+    int end = x < i0 ? i0 : x1;
+    bool uncovered = stamps[x - x0] == 0;
+    int k = x + 1;
+    while (k < end && (stamps[k - x0] == 0) == uncovered) {
+      k++;
+    }
+    if (uncovered) {
+      warpRow(y, x, k, out + (x - x0)*cn);
+      std::fill(stamps + (x - x0), stamps + (k - x0), stamp);
+    } else if (policy == Policy::SEAM_BLEND) {
+      blendSeam(y, x, k, out + (x - x0)*cn, band);
+      std::fill(stamps + (x - x0), stamps + (k - x0), stamp);
+    }
+    x = k;
+  }
+}
+
+void AffineWarp::blendSeam(int y, int x0, int x1, uchar* out, int band) {
+  int cn = src.channels();
+  uchar buf[BLOCK*4];
+  for (int x=x0; x<x1; x+=BLOCK) {
+    int n = std::min(BLOCK, x1 - x);
+    warpRow(y, x, x + n, buf);
+    uchar* o = out + (x - x0)*cn;
+    for (int i=0; i<n; i++) {
+      // Weight the new pixel by its distance from the frame's edge, 0 to 256 over the band.
+      double u = inv(0,0)*(x + i) + inv(0,1)*y + inv(0,2);
+      double v = inv(1,0)*(x + i) + inv(1,1)*y + inv(1,2);
+      double d = std::min(std::min(u + 0.5, src.cols - 0.5 - u),
+			  std::min(v + 0.5, src.rows - 0.5 - v));
+      int a = std::min(std::max(cvRound(d * 256 / band), 0), 256);
+      for (int c=0; c<cn; c++, o++) {
+	*o = (uchar)(*o + (((buf[i*cn + c] - *o) * a + 128) >> 8));
+      }
+    }
+  }
+}
+
+void AffineWarp::warp(Mat dst, Point offset) {
+  CV_Assert(dst.type() == src.type());
+  Mat stamps;
+  parallel_for_(Range(0, dst.rows),
+		WarpRows(this, dst, stamps, offset, NULL, Policy::KEEP_NEWEST, 0, 0),
+		std::max(1.0, (double)dst.rows / BAND_ROWS));
+}
+
+void AffineWarp::warp(Mat dst, Point offset, Scalar fill) {
+  CV_Assert(dst.type() == src.type());
+  Mat stamps;
+  parallel_for_(Range(0, dst.rows),
+		WarpRows(this, dst, stamps, offset, &fill, Policy::KEEP_NEWEST, 0, 0),
+		std::max(1.0, (double)dst.rows / BAND_ROWS));
+}
+
+void AffineWarp::compose(Mat dst, Mat stamps, Point offset, Policy policy, ushort stamp,
+			 int band) {
+  CV_Assert(dst.type() == src.type() && stamps.type() == CV_16U && stamps.size() == dst.size());
+  parallel_for_(Range(0, dst.rows),
+		WarpRows(this, dst, stamps, offset, NULL, policy, stamp, std::max(band, 1)),
+		std::max(1.0, (double)dst.rows / BAND_ROWS));
+}
@@ -0,0 +1,91 @@
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#ifndef AFFINE_WARP
+#define AFFINE_WARP
+
+using namespace cv;
+using namespace std;
+
+/**
+ * Affine warp of an 8-bit image that writes straight into its destination. Each destination
+ * pixel is mapped back into the source; the pixels that land inside it are covered and get
+ * a bilinear sample, and the rest are left untouched. This replaces warping the image and a
+ * full mask separately and then copying one through the other.
+ *
+ * Coordinates are in fixed point and sampled at 1/32 pixel, as in cv::warpAffine, and the
+ * coverage of a row is solved for directly, so a row only visits the pixels it writes.
+ */
+class AffineWarp {
+  public:
+    /** What composing does where the destination already has content. */
+    enum Policy {
+      /** Overwrite it. */
+      KEEP_NEWEST = 0,
+      /** Leave it; only write uncovered pixels. */
+      FILL_UNCOVERED = 1,
+      /** Blend into it within the seam band along the frame's edge and overwrite it
+	  further in. */
+      SEAM_BLEND = 2,
+    };
+
+    /** Policy named "newest", "fill" or "seam". False if name isn't one of them. */
+    static bool parsePolicy(const string& name, Policy& policy);
+
+    /** transform maps src coordinates to destination coordinates, or the reverse if
+	inverse is set, as with WARP_INVERSE_MAP. */
+    AffineWarp(Mat src, Matx23f transform, bool inverse=false);
+
+    /** Destination pixels the warped image may cover. */
+    Rect bounds();
+
+    /** Covered pixels [x0, x1) of destination row y. False if there are none. */
+    bool span(int y, int& x0, int& x1);
+
+    /** Whether any pixel of destination region r is covered. */
+    bool covers(Rect r);
+
+    /** Warp pixels [x0, x1) of destination row y into out, which points at pixel x0. The
+	pixels must be covered; see span(). */
+    void warpRow(int y, int x0, int x1, uchar* out);
+
+    /** Warp into dst, whose top-left is at offset in destination coordinates, in parallel
+	row bands. Only covered pixels are written. */
+    void warp(Mat dst, Point offset);
+
+    /** Warp into dst as above and set its uncovered pixels to fill, in the same pass. */
+    void warp(Mat dst, Point offset, Scalar fill);
+
+    /**
+     * Warp into dst per policy. stamps is dst's coverage map, CV_16U and 0 where dst has no
+     * content; pixels written are stamped with stamp. band: seam width in SEAM_BLEND, in
+     * pixels.
+     */
+    void compose(Mat dst, Mat stamps, Point offset, Policy policy, ushort stamp, int band);
+
+    /** Compose pixels [x0, x1) of destination row y into out, per the coverage stamps of
+	the same pixels. The pixels must be covered. */
+    void composeRow(int y, int x0, int x1, uchar* out, ushort* stamps, Policy policy,
+		    ushort stamp, int band);
+
+  private:
+    /** Pixels of row y at least inset pixels inside the warped image. */
+    bool span(int y, double inset, int& x0, int& x1);
+
+    /** Blend pixels [x0, x1) of row y into out by their distance from the image edge. */
+    void blendSeam(int y, int x0, int x1, uchar* out, int band);
+
+    Mat src;
+
+    /** Destination to source. */
+    Matx23d inv;
+
+    Rect area;
+
+    /** Fixed-point source offsets of each column of area, per destination column. */
+    vector<int> adelta;
+
+    vector<int> bdelta;
+};
+
+#endif